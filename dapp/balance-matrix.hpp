@@ -0,0 +1,359 @@
+#ifndef BALANCE_MATRIX_H
+#define BALANCE_MATRIX_H
+
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <new>
+#include <vector>
+
+#include "memory-arena.hpp"
+
+////////////////////////////////////////////////////////////////////////////////
+// Dense trader and token ids, and the balance matrix they index
+
+namespace perna {
+
+using account_id_type = uint32_t; // dense trader id
+using token_id_type = uint32_t;   // dense token id
+
+template <typename T>
+using wallet_allocator_type = arena_allocator<T, arena_usage_what::wallet>;
+
+// Interns addresses into dense ids, handed out in order of first sight.
+// Open addressing with linear probing over a power-of-two table allocated from the arena. Anyone can pick addresses
+// that share their leading bytes, such as vanity addresses, so all 20 bytes are folded into the hash.
+class address_directory_type {
+public:
+    struct slot_type {
+        eth_address address;
+        uint32_t entry; // 1 + id of the address, 0 marks an empty slot
+    };
+
+private:
+
+    using addresses_type = std::vector<eth_address, wallet_allocator_type<eth_address>>;
+
+    static constexpr uint32_t INITIAL_CAPACITY = 64;
+
+    wallet_allocator_type<slot_type>::pointer m_slots;
+    uint32_t m_capacity{0};
+    addresses_type m_addresses; // interned addresses, indexed by id
+
+    uint32_t home(const eth_address &address) const {
+        constexpr uint64_t K = UINT64_C(0x9e3779b97f4a7c15);
+        uint64_t words[3] = {0, 0, 0};
+        memcpy(words, address.data(), address.size());
+        auto key = (((words[0] * K) ^ words[1]) * K) ^ words[2];
+        return (key * K) >> (64 - std::countr_zero(m_capacity));
+    }
+
+    bool rehash(uint32_t capacity) {
+        auto old_slots = m_slots;
+        auto old_capacity = m_capacity;
+        m_slots = slot_allocator().allocate(capacity);
+        if (!m_slots) {
+            m_slots = old_slots;
+            return false;
+        }
+        std::fill_n(m_slots.get(), capacity, slot_type{{}, 0});
+        m_capacity = capacity;
+        for (uint32_t i = 0; i < old_capacity; ++i) {
+            if (old_slots[i].entry != 0) {
+                auto j = home(old_slots[i].address);
+                while (m_slots[j].entry != 0) {
+                    j = (j + 1) & (m_capacity - 1);
+                }
+                m_slots[j] = old_slots[i];
+            }
+        }
+        if (old_slots) {
+            slot_allocator().deallocate(old_slots, old_capacity);
+        }
+        return true;
+    }
+
+    // make room for count addresses, unless the arena has none left
+    bool reserve_addresses(uint64_t count) {
+        if (count > m_addresses.capacity() &&
+            !m_addresses.get_allocator().get_arena()->can_allocate({count * sizeof(eth_address)})) {
+            return false;
+        }
+        m_addresses.reserve(count);
+        return true;
+    }
+
+    // slots come from the same arena as the addresses
+    wallet_allocator_type<slot_type> slot_allocator() const {
+        return wallet_allocator_type<slot_type>{m_addresses.get_allocator()};
+    }
+
+public:
+    static constexpr uint32_t NO_ID = UINT32_MAX;
+
+    explicit address_directory_type(memory_arena *arena) : m_addresses(wallet_allocator_type<eth_address>{arena}) {}
+
+    uint32_t size() const {
+        return static_cast<uint32_t>(m_addresses.size());
+    }
+
+    const eth_address &address(uint32_t id) const {
+        return m_addresses[id];
+    }
+
+    // id of address, or NO_ID if it was never interned
+    uint32_t find(const eth_address &address) const {
+        if (m_addresses.empty()) {
+            return NO_ID;
+        }
+        for (auto i = home(address);; i = (i + 1) & (m_capacity - 1)) {
+            if (m_slots[i].entry == 0) {
+                return NO_ID;
+            }
+            if (m_slots[i].address == address) {
+                return m_slots[i].entry - 1;
+            }
+        }
+    }
+
+    // make room for count addresses at once, so interning them never rehashes. Returns false if the arena is full.
+    bool reserve(uint32_t count) {
+        if (2 * uint64_t{count} > m_capacity && !rehash(std::max(INITIAL_CAPACITY, std::bit_ceil(2 * count)))) {
+            return false;
+        }
+        return reserve_addresses(count);
+    }
+
+    // id of address, assigning the next one if it was never interned, or NO_ID if the arena is full
+    uint32_t intern(const eth_address &address) {
+        // keep load factor at or below 1/2 so probe sequences stay short
+        if (2 * (size() + 1) > m_capacity && !rehash(m_capacity ? 2 * m_capacity : INITIAL_CAPACITY)) {
+            return NO_ID;
+        }
+        auto i = home(address);
+        while (m_slots[i].entry != 0) {
+            if (m_slots[i].address == address) {
+                return m_slots[i].entry - 1;
+            }
+            i = (i + 1) & (m_capacity - 1);
+        }
+        if (size() == m_addresses.capacity() &&
+            !reserve_addresses(std::max(uint64_t{INITIAL_CAPACITY}, 2 * uint64_t{size()}))) {
+            return NO_ID;
+        }
+        m_addresses.push_back(address);
+        m_slots[i] = slot_type{address, size()};
+        return size() - 1;
+    }
+
+    // allocate the table and the addresses again from an arena cleared for compaction
+    void compact(const arena_evacuation_type &old) {
+        const auto *slots = old.moved(m_slots.get());
+        const auto *addresses = old.moved(m_addresses.data());
+        auto count = m_addresses.size();
+        auto allocator = m_addresses.get_allocator();
+        m_slots = m_capacity ? slot_allocator().allocate(m_capacity) : nullptr;
+        std::copy_n(slots, m_capacity, m_slots.get());
+        // the old storage went away with the rest of the arena, so the vector is replaced rather than destroyed
+        new (&m_addresses) addresses_type(allocator);
+        m_addresses.assign(addresses, addresses + count);
+    }
+};
+
+// Balances of every account in every token.
+// The tokens that can be traded are the first columns, one contiguous row per account, so matching reads the balances
+// of a trader at fixed offsets. Rows are padded to a power-of-two number of columns, so a trader holding the first 16
+// tokens takes two cache lines, and adding rows keeps every slot where it is.
+// Anyone can deposit any token, so every other token is kept in a sparse table holding only the balances deposited,
+// keyed by account and token with open addressing over a power-of-two table, instead of widening every row.
+class balance_matrix_type {
+public:
+    struct other_balance_type {
+        uint64_t key; // account and token, EMPTY_KEY marks an empty slot
+        currency_type amount;
+    };
+
+private:
+
+    static constexpr uint32_t INITIAL_ROWS = 64;
+    static constexpr uint32_t INITIAL_OTHERS = 64;
+    static constexpr uint64_t EMPTY_KEY = UINT64_MAX;
+
+    wallet_allocator_type<currency_type> m_allocator;
+    wallet_allocator_type<currency_type>::pointer m_balances;
+    uint32_t m_row_capacity{0};
+    uint32_t m_column_count; // tokens kept in rows
+    uint32_t m_columns;      // row stride
+    wallet_allocator_type<other_balance_type>::pointer m_others;
+    uint32_t m_other_capacity{0};
+    uint32_t m_other_count{0};
+
+    static uint64_t other_key(account_id_type account, token_id_type token) {
+        return (uint64_t{account} << 32) | token;
+    }
+
+    uint32_t other_home(uint64_t key) const {
+        return (key * UINT64_C(0x9e3779b97f4a7c15)) >> (64 - std::countr_zero(m_other_capacity));
+    }
+
+    // slot of the other balance under key, or of the empty slot it would go in
+    uint32_t find_other(uint64_t key) const {
+        auto i = other_home(key);
+        while (m_others[i].key != key && m_others[i].key != EMPTY_KEY) {
+            i = (i + 1) & (m_other_capacity - 1);
+        }
+        return i;
+    }
+
+    bool relayout(uint32_t row_capacity) {
+        auto balances = m_allocator.allocate(uint64_t{row_capacity} * m_columns);
+        if (!balances) {
+            return false;
+        }
+        std::fill_n(balances.get(), uint64_t{row_capacity} * m_columns, currency_type{0});
+        std::copy_n(m_balances.get(), uint64_t{m_row_capacity} * m_columns, balances.get());
+        if (m_balances) {
+            m_allocator.deallocate(m_balances, uint64_t{m_row_capacity} * m_columns);
+        }
+        m_balances = balances;
+        m_row_capacity = row_capacity;
+        return true;
+    }
+
+    bool rehash_others(uint32_t capacity) {
+        auto old_others = m_others;
+        auto old_capacity = m_other_capacity;
+        m_others = other_allocator().allocate(capacity);
+        if (!m_others) {
+            m_others = old_others;
+            return false;
+        }
+        std::fill_n(m_others.get(), capacity, other_balance_type{EMPTY_KEY, 0});
+        m_other_capacity = capacity;
+        for (uint32_t i = 0; i < old_capacity; ++i) {
+            if (old_others[i].key != EMPTY_KEY) {
+                m_others[find_other(old_others[i].key)] = old_others[i];
+            }
+        }
+        if (old_others) {
+            other_allocator().deallocate(old_others, old_capacity);
+        }
+        return true;
+    }
+
+    wallet_allocator_type<other_balance_type> other_allocator() const {
+        return wallet_allocator_type<other_balance_type>{m_allocator};
+    }
+
+public:
+    using slot_type = uint64_t; // position of one balance in the rows
+
+    // balances with the first column_count tokens in rows
+    balance_matrix_type(memory_arena *arena, uint32_t column_count) :
+        m_allocator(arena),
+        m_column_count(column_count),
+        m_columns(std::bit_ceil(column_count)) {}
+
+    // tokens kept in rows
+    uint32_t get_column_count() const {
+        return m_column_count;
+    }
+
+    // make room for rows accounts, unless the arena is full
+    bool reserve(uint32_t rows) {
+        return rows <= m_row_capacity || relayout(std::max({std::bit_ceil(rows), m_row_capacity, INITIAL_ROWS}));
+    }
+
+    // make room for count balances in other tokens, unless the arena is full
+    bool reserve_others(uint64_t count) {
+        // keep load factor at or below 1/2 so probe sequences stay short
+        if (2 * count <= m_other_capacity) {
+            return true;
+        }
+        return count <= UINT32_MAX / 4 &&
+            rehash_others(std::max(INITIAL_OTHERS, std::bit_ceil(static_cast<uint32_t>(2 * count))));
+    }
+
+    // slot of a token kept in rows, which stays valid until the next reserve that adds rows
+    slot_type slot(account_id_type account, token_id_type token) const {
+        return uint64_t{account} * m_columns + token;
+    }
+
+    currency_type &operator[](slot_type slot) {
+        return m_balances[slot];
+    }
+
+    // balance of an account in a token kept in rows
+    currency_type &at(account_id_type account, token_id_type token) {
+        return m_balances[slot(account, token)];
+    }
+
+    // balance of an account in any token, zero if it never held any
+    currency_type get(account_id_type account, token_id_type token) const {
+        if (token < m_column_count) {
+            return m_balances[slot(account, token)];
+        }
+        if (m_other_count == 0) {
+            return 0;
+        }
+        const auto &other = m_others[find_other(other_key(account, token))];
+        return other.key == EMPTY_KEY ? 0 : other.amount;
+    }
+
+    // balance of an account in any token, added if it never held any, or nullptr if the arena is full
+    currency_type *find_or_add(account_id_type account, token_id_type token) {
+        if (token < m_column_count) {
+            return &at(account, token);
+        }
+        auto key = other_key(account, token);
+        if (m_other_count > 0) {
+            auto i = find_other(key);
+            if (m_others[i].key == key) {
+                return &m_others[i].amount;
+            }
+        }
+        if (!reserve_others(uint64_t{m_other_count} + 1)) {
+            return nullptr;
+        }
+        auto i = find_other(key);
+        m_others[i] = other_balance_type{key, 0};
+        ++m_other_count;
+        return &m_others[i].amount;
+    }
+
+    // all balances of an account in the tokens kept in rows, indexed by token id
+    const currency_type *row(account_id_type account) const {
+        return m_balances.get() + uint64_t{account} * m_columns;
+    }
+
+    // balances in other tokens ever added, including those that went back to zero
+    uint32_t get_other_count() const {
+        return m_other_count;
+    }
+
+    // visit every balance in other tokens ever added, in no particular order
+    template <typename F>
+    void for_each_other(F &&f) const {
+        for (uint32_t i = 0; i < m_other_capacity; ++i) {
+            if (m_others[i].key != EMPTY_KEY) {
+                f(static_cast<account_id_type>(m_others[i].key >> 32), static_cast<token_id_type>(m_others[i].key),
+                    m_others[i].amount);
+            }
+        }
+    }
+
+    // allocate the rows and the other balances again from an arena cleared for compaction, keeping their layout
+    void compact(const arena_evacuation_type &old) {
+        const auto *balances = old.moved(m_balances.get());
+        auto length = uint64_t{m_row_capacity} * m_columns;
+        m_balances = length ? m_allocator.allocate(length) : nullptr;
+        std::copy_n(balances, length, m_balances.get());
+        const auto *others = old.moved(m_others.get());
+        m_others = m_other_capacity ? other_allocator().allocate(m_other_capacity) : nullptr;
+        std::copy_n(others, m_other_capacity, m_others.get());
+    }
+};
+
+} // namespace perna
+
+#endif
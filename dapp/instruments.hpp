@@ -0,0 +1,153 @@
+#ifndef INSTRUMENTS_H
+#define INSTRUMENTS_H
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+#include "balance-matrix.hpp"
+
+////////////////////////////////////////////////////////////////////////////////
+// Instruments traded by the exchange, all known at compile time
+
+namespace perna {
+
+struct instrument_spec_type {
+    symbol_type symbol; // instrument's symbol (ticker)
+    token_type base;    // token being traded
+    token_type quote;   // quote token - "price " of 1 base token
+};
+
+// The one list of instruments. Everything below is derived from it at compile time.
+constexpr instrument_spec_type INSTRUMENT_SPECS[] = {
+    {symbol_type{"ADA/USDT"}, ADA_ADDRESS, USDT_ADDRESS},
+    {symbol_type{"BNB/USDT"}, BNB_ADDRESS, USDT_ADDRESS},
+    {symbol_type{"BTC/USDT"}, BTC_ADDRESS, USDT_ADDRESS},
+    {symbol_type{"CTSI/USDT"}, CTSI_ADDRESS, USDT_ADDRESS},
+    {symbol_type{"DAI/USDT"}, DAI_ADDRESS, USDT_ADDRESS},
+    {symbol_type{"DOGE/USDT"}, DOGE_ADDRESS, USDT_ADDRESS},
+    {symbol_type{"SOL/USDT"}, SOL_ADDRESS, USDT_ADDRESS},
+    {symbol_type{"TON/USDT"}, TON_ADDRESS, USDT_ADDRESS},
+    {symbol_type{"XRP/USDT"}, XRP_ADDRESS, USDT_ADDRESS},
+    {symbol_type{"ADA/BTC"}, ADA_ADDRESS, BTC_ADDRESS},
+    {symbol_type{"BNB/BTC"}, BNB_ADDRESS, BTC_ADDRESS},
+    {symbol_type{"CTSI/BTC"}, CTSI_ADDRESS, BTC_ADDRESS},
+    {symbol_type{"XRP/BTC"}, XRP_ADDRESS, BTC_ADDRESS},
+};
+
+constexpr size_t INSTRUMENT_COUNT = std::size(INSTRUMENT_SPECS);
+
+// Trading instrument
+struct instrument_type {
+    symbol_type symbol;     // instrument's symbol (ticker)
+    token_type base;        // token being traded
+    token_type quote;       // quote token - "price " of 1 base token
+    token_id_type base_id;  // position of base in INSTRUMENT_TOKENS
+    token_id_type quote_id; // position of quote in INSTRUMENT_TOKENS
+    uint32_t index;         // position of the instrument in INSTRUMENTS
+};
+
+// Distinct tokens of all instruments, in order of first appearance.
+// The exchange interns them before any other token, so their position here is also their token id.
+struct instrument_tokens_type {
+    std::array<token_type, 2 * INSTRUMENT_COUNT> tokens;
+    size_t count;
+};
+
+constexpr instrument_tokens_type collect_instrument_tokens() {
+    instrument_tokens_type r{};
+    for (const auto &spec : INSTRUMENT_SPECS) {
+        for (const auto &token : {spec.base, spec.quote}) {
+            if (std::find(r.tokens.begin(), r.tokens.begin() + r.count, token) == r.tokens.begin() + r.count) {
+                r.tokens[r.count++] = token;
+            }
+        }
+    }
+    return r;
+}
+
+constexpr size_t INSTRUMENT_TOKEN_COUNT = collect_instrument_tokens().count;
+
+constexpr auto INSTRUMENT_TOKENS = [] {
+    std::array<token_type, INSTRUMENT_TOKEN_COUNT> tokens{};
+    std::copy_n(collect_instrument_tokens().tokens.begin(), INSTRUMENT_TOKEN_COUNT, tokens.begin());
+    return tokens;
+}();
+
+constexpr auto INSTRUMENTS = [] {
+    auto token_id = [](const token_type &token) {
+        return static_cast<token_id_type>(
+            std::find(INSTRUMENT_TOKENS.begin(), INSTRUMENT_TOKENS.end(), token) - INSTRUMENT_TOKENS.begin());
+    };
+    std::array<instrument_type, INSTRUMENT_COUNT> instruments{};
+    for (uint32_t i = 0; i < INSTRUMENT_COUNT; ++i) {
+        const auto &spec = INSTRUMENT_SPECS[i];
+        instruments[i] =
+            instrument_type{spec.symbol, spec.base, spec.quote, token_id(spec.base), token_id(spec.quote), i};
+    }
+    return instruments;
+}();
+
+// Perfect hash from symbols to instruments.
+// A symbol is folded into a 64-bit key, and a multiplier found at compile time sends the keys of all instruments to
+// distinct slots of a table that fits in one cache line.
+constexpr int INSTRUMENT_SLOT_BITS = 6;
+using instrument_slots_type = std::array<uint8_t, 1 << INSTRUMENT_SLOT_BITS>;
+static_assert(INSTRUMENT_COUNT <= 256, "instrument index must fit in a slot");
+
+constexpr uint64_t symbol_key(const symbol_type &symbol) {
+    uint64_t lo = 0;
+    for (int i = 0; i < 8; ++i) {
+        lo |= uint64_t{static_cast<uint8_t>(symbol[i])} << (8 * i);
+    }
+    uint64_t hi = uint64_t{static_cast<uint8_t>(symbol[8])} | uint64_t{static_cast<uint8_t>(symbol[9])} << 8;
+    return lo ^ (hi * UINT64_C(0x100000001b3));
+}
+
+constexpr uint32_t symbol_slot(const symbol_type &symbol, uint64_t multiplier) {
+    return static_cast<uint32_t>((symbol_key(symbol) * multiplier) >> (64 - INSTRUMENT_SLOT_BITS));
+}
+
+constexpr uint64_t INSTRUMENT_HASH_MULTIPLIER = [] {
+    for (uint64_t multiplier = UINT64_C(0x9e3779b97f4a7c15);; multiplier += 2) {
+        std::array<bool, 1 << INSTRUMENT_SLOT_BITS> used{};
+        bool collision = false;
+        for (const auto &instrument : INSTRUMENTS) {
+            auto slot = symbol_slot(instrument.symbol, multiplier);
+            collision = collision || used[slot];
+            used[slot] = true;
+        }
+        if (!collision) {
+            return multiplier;
+        }
+    }
+}();
+
+// Slots not taken by an instrument point to the first one, whose symbol will not match
+constexpr auto INSTRUMENT_SLOTS = [] {
+    instrument_slots_type slots{};
+    for (const auto &instrument : INSTRUMENTS) {
+        slots[symbol_slot(instrument.symbol, INSTRUMENT_HASH_MULTIPLIER)] = static_cast<uint8_t>(instrument.index);
+    }
+    return slots;
+}();
+
+// instrument traded under symbol, or nullptr if there is none
+constexpr const instrument_type *find_instrument(const symbol_type &symbol) {
+    const auto &instrument = INSTRUMENTS[INSTRUMENT_SLOTS[symbol_slot(symbol, INSTRUMENT_HASH_MULTIPLIER)]];
+    return instrument.symbol == symbol ? &instrument : nullptr;
+}
+
+static_assert([] {
+    for (const auto &instrument : INSTRUMENTS) {
+        if (find_instrument(instrument.symbol) != &instrument) {
+            return false;
+        }
+    }
+    return find_instrument(symbol_type{"CTSI/ETH"}) == nullptr;
+}(), "instrument perfect hash is broken");
+
+} // namespace perna
+
+#endif
@@ -0,0 +1,372 @@
+#ifndef MEMORY_ARENA_H
+#define MEMORY_ARENA_H
+
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+#include "offset-ptr.hpp"
+
+////////////////////////////////////////////////////////////////////////////////
+// Arena living inside the lambda, and the allocator that carves nodes from it
+
+// Blocks are rounded up to a size class and carved from the end of the used area. Freed blocks go to a free list per
+// size class and are handed out again before the used area grows. Classes are 16 bytes apart up to 64 bytes and then
+// four per power of two, so rounding wastes at most a fifth of a block. The free lists are kept as offsets into the
+// arena, threaded through the free blocks themselves, so they survive restarts along with the rest of the lambda.
+// Blocks whose class is a multiple of the 64-byte cache line start on a line boundary, so a node sized to one line
+// never straddles two; the 16 to 48 bytes skipped to get there go to the free lists of the small classes.
+// Live blocks are counted by what they are used for, so operators can see what fills the arena.
+// Nothing is ever written past the used area, so the arena keeps the furthest the used area reached since the
+// lambda was last flushed, which bounds the range a flush has to cover.
+// A new arena relies on its memory being zero, as a fresh image is, instead of clearing it up front. When it replaces
+// a previous arena, it is told how far the previous one ever reached, and zeroes what that one left behind a block at
+// a time as its used area advances over it, so only memory about to be used is ever touched.
+// Compaction empties the arena and has the structures living in it allocate their blocks again, in the order they are
+// walked, so the blocks used together end up next to each other and the free lists are gone.
+
+// What an arena block is used for
+enum class arena_usage_what : uint8_t {
+    order = 0,  // order nodes and the order index
+    book = 1,   // price levels and the ladders pointing to them
+    wallet = 2, // balance matrix and address directories
+    other = 3,
+};
+
+constexpr int ARENA_USAGE_COUNT = 4;
+
+// Live blocks of one usage, with lengths rounded up to their size class
+struct arena_usage_type {
+    uint64_t bytes;
+    uint64_t block_count;
+};
+
+class memory_arena {
+    static constexpr uint64_t NO_BLOCK = UINT64_MAX;
+    static constexpr int SIZE_CLASS_COUNT = 192;
+    static constexpr uint64_t CACHE_LINE = 64;
+
+    uint64_t m_length;
+    uint64_t m_next_free;
+    uint64_t m_live_bytes;
+    uint64_t m_peak_live_bytes;
+    uint64_t m_dirty_length; // furthest the used area reached since the last flush
+    uint64_t m_extent;       // furthest the used area ever reached
+    uint64_t m_stale_length; // bytes of the data area a previous arena may have left data in
+    uint64_t m_fresh_length; // bytes of the data area zeroed or used by this arena
+    arena_usage_type m_usage[ARENA_USAGE_COUNT];
+    uint64_t m_free_lists[SIZE_CLASS_COUNT]; // offset of first free block of each class, or NO_BLOCK
+    alignas(CACHE_LINE) unsigned char m_data[0];
+
+    static int size_class(uint64_t length) {
+        if (length <= 64) {
+            return length == 0 ? 0 : static_cast<int>((length - 1) / 16);
+        }
+        // 2^k < length <= 2^(k+1), split into 4 steps of 2^(k-2)
+        int k = std::bit_width(length - 1) - 1;
+        int step = static_cast<int>((length - 1 - (UINT64_C(1) << k)) >> (k - 2));
+        return 4 + 4 * (k - 6) + step;
+    }
+
+    static uint64_t class_length(int c) {
+        if (c < 4) {
+            return 16 * static_cast<uint64_t>(c + 1);
+        }
+        int k = 6 + (c - 4) / 4;
+        return (UINT64_C(1) << k) + static_cast<uint64_t>((c - 4) % 4 + 1) * (UINT64_C(1) << (k - 2));
+    }
+
+    uint64_t &next_of(uint64_t offset) {
+        return *reinterpret_cast<uint64_t *>(m_data + offset);
+    }
+
+    // zero whatever a previous arena left before offset
+    void freshen(uint64_t offset) {
+        if (offset > m_fresh_length && m_fresh_length < m_stale_length) {
+            std::fill(m_data + m_fresh_length, m_data + std::min(offset, m_stale_length), 0);
+        }
+        m_fresh_length = std::max(m_fresh_length, offset);
+    }
+
+    // offset a block of rounded bytes would be carved at from next_free, or NO_BLOCK if it does not fit
+    uint64_t carve_offset(uint64_t next_free, uint64_t rounded) const {
+        auto offset = next_free;
+        if (rounded % CACHE_LINE == 0) {
+            offset = (offset + CACHE_LINE - 1) & ~(CACHE_LINE - 1);
+        }
+        if (offset > get_data_length() || rounded > get_data_length() - offset) {
+            return NO_BLOCK;
+        }
+        return offset;
+    }
+
+public:
+    // arena of length bytes over memory that is zero past the stale_length bytes a previous arena may have used
+    explicit memory_arena(uint64_t length, uint64_t stale_length = 0) :
+        m_length(length),
+        m_next_free(0),
+        m_live_bytes(0),
+        m_peak_live_bytes(0),
+        m_dirty_length(0),
+        m_extent(0),
+        m_stale_length(stale_length),
+        m_fresh_length(0),
+        m_usage{} {
+        for (auto &head : m_free_lists) {
+            head = NO_BLOCK;
+        }
+    }
+
+    void *get_data() {
+        return m_data;
+    }
+
+    // whether blocks of all of lengths, each of another size class, can be allocated one after the other
+    bool can_allocate(std::initializer_list<uint64_t> lengths) const {
+        auto next_free = m_next_free;
+        for (auto length : lengths) {
+            auto c = size_class(length);
+            if (m_free_lists[c] != NO_BLOCK) {
+                continue;
+            }
+            auto offset = carve_offset(next_free, class_length(c));
+            if (offset == NO_BLOCK) {
+                return false;
+            }
+            next_free = offset + class_length(c);
+        }
+        return true;
+    }
+
+    // block of length bytes, or nullptr if the arena is full
+    void *allocate(uint64_t length, arena_usage_what usage = arena_usage_what::other) {
+        auto c = size_class(length);
+        auto rounded = class_length(c);
+        auto offset = m_free_lists[c];
+        if (offset != NO_BLOCK) {
+            m_free_lists[c] = next_of(offset);
+        } else {
+            offset = carve_offset(m_next_free, rounded);
+            if (offset == NO_BLOCK) {
+                return nullptr;
+            }
+            freshen(offset + rounded);
+            if (offset != m_next_free) {
+                // every class is a multiple of 16 bytes, so the gap is exactly one small block
+                auto gap = size_class(offset - m_next_free);
+                next_of(m_next_free) = m_free_lists[gap];
+                m_free_lists[gap] = m_next_free;
+            }
+            m_next_free = offset + rounded;
+            m_dirty_length = std::max(m_dirty_length, m_next_free);
+            m_extent = std::max(m_extent, m_next_free);
+        }
+        auto &u = m_usage[static_cast<int>(usage)];
+        u.bytes += rounded;
+        ++u.block_count;
+        m_live_bytes += rounded;
+        m_peak_live_bytes = std::max(m_peak_live_bytes, m_live_bytes);
+        return m_data + offset;
+    }
+
+    void deallocate(void *p, uint64_t length, arena_usage_what usage = arena_usage_what::other) {
+        if (!p) {
+            return;
+        }
+        auto c = size_class(length);
+        auto rounded = class_length(c);
+        auto offset = offset_of(p);
+        next_of(offset) = m_free_lists[c];
+        m_free_lists[c] = offset;
+        auto &u = m_usage[static_cast<int>(usage)];
+        u.bytes -= rounded;
+        --u.block_count;
+        m_live_bytes -= rounded;
+    }
+
+    // offset of a block from the start of the data area, which does not depend on where the lambda is mapped
+    uint64_t offset_of(const void *p) const {
+        return static_cast<uint64_t>(static_cast<const unsigned char *>(p) - m_data);
+    }
+
+    // block at offset from the start of the data area
+    void *at(uint64_t offset) const {
+        return const_cast<unsigned char *>(m_data) + offset;
+    }
+
+    // bytes of the arena, counting its own fields ahead of the data area
+    uint64_t get_length() const {
+        return m_length;
+    }
+
+    uint64_t get_data_length() const {
+        return m_length - offsetof(memory_arena, m_data);
+    }
+
+    // bytes carved from the arena so far, whether live or waiting in a free list
+    uint64_t get_used_length() const {
+        return m_next_free;
+    }
+
+    // bytes in live blocks
+    uint64_t get_live_length() const {
+        return m_live_bytes;
+    }
+
+    // most bytes ever live at once
+    uint64_t get_peak_live_length() const {
+        return m_peak_live_bytes;
+    }
+
+    // bytes waiting in free lists
+    uint64_t get_free_list_length() const {
+        return m_next_free - m_live_bytes;
+    }
+
+    // blocks waiting in free lists, walking every list
+    uint64_t get_free_block_count() const {
+        uint64_t count = 0;
+        for (auto head : m_free_lists) {
+            for (auto offset = head; offset != NO_BLOCK; offset = *reinterpret_cast<const uint64_t *>(m_data + offset)) {
+                ++count;
+            }
+        }
+        return count;
+    }
+
+    // bytes from the start of the data area that were ever used
+    uint64_t get_extent() const {
+        return m_extent;
+    }
+
+    // bytes from the start of the data area that may have changed since the last flush
+    uint64_t get_dirty_length() const {
+        return m_dirty_length;
+    }
+
+    // note that everything written so far was flushed
+    void mark_flushed() {
+        m_dirty_length = m_next_free;
+    }
+
+    const arena_usage_type &get_usage(arena_usage_what usage) const {
+        return m_usage[static_cast<int>(usage)];
+    }
+
+    // take in length bytes from the start of the arena, once the memory after it was made available
+    void grow(uint64_t length) {
+        m_length = std::max(m_length, length);
+    }
+
+    // drop every block at once, leaving the high watermarks alone
+    void clear() {
+        m_next_free = 0;
+        m_live_bytes = 0;
+        for (auto &u : m_usage) {
+            u = arena_usage_type{0, 0};
+        }
+        for (auto &head : m_free_lists) {
+            head = NO_BLOCK;
+        }
+    }
+};
+
+// Copy of the used area of an arena, taken when the arena is cleared for compaction.
+// Blocks keep their offsets in the copy, and offset pointers between them keep working there, so the structures
+// can read their old blocks from it while they allocate new ones from the cleared arena.
+// The copy is kept in whole cache lines, so blocks aligned in the arena stay aligned in the copy.
+// The used area can be larger than the memory of the process, as a flash drive of the emulator can be, so taking the
+// copy may fail, and the arena is then left as it was.
+class arena_evacuation_type {
+    struct alignas(64) line_type {
+        unsigned char bytes[64];
+    };
+
+    memory_arena *m_arena;
+    std::unique_ptr<line_type[]> m_copy;
+
+public:
+    explicit arena_evacuation_type(memory_arena *arena) : m_arena(arena) {}
+
+    // Copy the used area and clear the arena, or return false, leaving the arena untouched, if there is no memory for
+    // the copy
+    bool evacuate() {
+        auto length = m_arena->get_used_length();
+        m_copy.reset(new (std::nothrow) line_type[(length + sizeof(line_type) - 1) / sizeof(line_type)]);
+        if (!m_copy) {
+            return false;
+        }
+        std::copy_n(static_cast<const unsigned char *>(m_arena->get_data()), length,
+            reinterpret_cast<unsigned char *>(m_copy.get()));
+        m_arena->clear();
+        return true;
+    }
+
+    arena_evacuation_type(const arena_evacuation_type &) = delete;
+    arena_evacuation_type &operator=(const arena_evacuation_type &) = delete;
+
+    // copy of the block at offset
+    const void *at(uint64_t offset) const {
+        return reinterpret_cast<const unsigned char *>(m_copy.get()) + offset;
+    }
+
+    // copy of the block p pointed to before the arena was cleared
+    template <typename T>
+    const T *moved(const T *p) const {
+        return p ? static_cast<const T *>(at(m_arena->offset_of(p))) : nullptr;
+    }
+};
+
+// Allocator carving blocks from the arena it was constructed with, counted under USAGE.
+// Containers keep their allocator, so every container draws from the arena of the lambda it lives in and several
+// lambdas can be open in the same process. The arena and the blocks are held through offset pointers, so containers
+// inside a lambda do not depend on where it is mapped.
+template <typename T, arena_usage_what USAGE = arena_usage_what::other>
+class arena_allocator {
+    offset_ptr<memory_arena> m_arena;
+
+public:
+    using pointer = offset_ptr<T>;
+    using const_pointer = offset_ptr<const T>;
+    using void_pointer = offset_ptr<void>;
+    using const_void_pointer = offset_ptr<const void>;
+    using value_type = T;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+    template <typename U>
+    struct rebind {
+        using other = arena_allocator<U, USAGE>;
+    };
+
+    explicit arena_allocator(memory_arena *arena) : m_arena(arena) {}
+
+    // same arena, possibly counted under another usage
+    template <typename U, arena_usage_what OTHER_USAGE>
+    explicit(OTHER_USAGE != USAGE) arena_allocator(const arena_allocator<U, OTHER_USAGE> &other) :
+        m_arena(other.get_arena()) {}
+
+    memory_arena *get_arena() const {
+        return m_arena.get();
+    }
+
+    pointer allocate(std::size_t n) {
+        return pointer(static_cast<T *>(m_arena->allocate(n * sizeof(T), USAGE)));
+    }
+
+    void deallocate(pointer p, std::size_t n) noexcept {
+        m_arena->deallocate(p.get(), n * sizeof(T), USAGE);
+    }
+
+    template <typename U, arena_usage_what OTHER_USAGE>
+    bool operator==(const arena_allocator<U, OTHER_USAGE> &other) const {
+        return m_arena == other.get_arena();
+    }
+};
+
+#endif
@@ -0,0 +1,169 @@
+#ifndef OFFSET_PTR_H
+#define OFFSET_PTR_H
+
+#include <compare>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <type_traits>
+
+////////////////////////////////////////////////////////////////////////////////
+// Self-relative pointer, so the structures in the lambda work wherever it is mapped
+
+// Holds the distance from its own address to the object it points to. A structure linked only through offset
+// pointers keeps working when the whole image is mapped at another address, because every distance inside it stays
+// the same. Copying an offset pointer recomputes the distance from the copy. Offset 0 stands for nullptr, as nothing
+// in the lambda points to itself.
+// Meets the allocator requirements for fancy pointers, so standard containers can keep their storage this way.
+template <typename T>
+class offset_ptr {
+    intptr_t m_offset;
+
+    // Address of this pointer as an opaque integer. Otherwise the compiler may fold base + offset back into
+    // arithmetic on this, conclude the target lies inside this object, and drop stores to the real target.
+    intptr_t base() const {
+        auto address = reinterpret_cast<intptr_t>(this);
+        __asm__("" : "+r"(address));
+        return address;
+    }
+
+    intptr_t offset_to(const volatile void *p) const {
+        return p ? reinterpret_cast<intptr_t>(p) - base() : 0;
+    }
+
+public:
+    using element_type = T;
+    using value_type = std::remove_cv_t<T>;
+    using difference_type = std::ptrdiff_t;
+    using pointer = offset_ptr;
+    using reference = std::add_lvalue_reference_t<T>;
+    using iterator_category = std::random_access_iterator_tag;
+    template <typename U>
+    using rebind = offset_ptr<U>;
+
+    offset_ptr() noexcept : m_offset(0) {}
+
+    offset_ptr(std::nullptr_t) noexcept : m_offset(0) {}
+
+    offset_ptr(T *p) noexcept : m_offset(offset_to(p)) {}
+
+    offset_ptr(const offset_ptr &other) noexcept : m_offset(offset_to(other.get())) {}
+
+    template <typename U>
+        requires std::is_convertible_v<U *, T *>
+    offset_ptr(const offset_ptr<U> &other) noexcept : m_offset(offset_to(static_cast<T *>(other.get()))) {}
+
+    // allocator_traits converts void pointers back to typed pointers with static_cast
+    template <typename U>
+        requires(!std::is_convertible_v<U *, T *> && std::is_void_v<U>)
+    explicit offset_ptr(const offset_ptr<U> &other) noexcept : m_offset(offset_to(static_cast<T *>(other.get()))) {}
+
+    offset_ptr &operator=(const offset_ptr &other) noexcept {
+        m_offset = offset_to(other.get());
+        return *this;
+    }
+
+    offset_ptr &operator=(T *p) noexcept {
+        m_offset = offset_to(p);
+        return *this;
+    }
+
+    offset_ptr &operator=(std::nullptr_t) noexcept {
+        m_offset = 0;
+        return *this;
+    }
+
+    T *get() const noexcept {
+        return m_offset ? reinterpret_cast<T *>(base() + m_offset) : nullptr;
+    }
+
+    template <typename U = T>
+        requires(!std::is_void_v<U>)
+    static offset_ptr pointer_to(U &r) noexcept {
+        return offset_ptr(&r);
+    }
+
+    explicit operator bool() const noexcept {
+        return m_offset != 0;
+    }
+
+    template <typename U = T>
+        requires(!std::is_void_v<U>)
+    U &operator*() const noexcept {
+        return *get();
+    }
+
+    T *operator->() const noexcept {
+        return get();
+    }
+
+    template <typename U = T>
+        requires(!std::is_void_v<U>)
+    U &operator[](difference_type n) const noexcept {
+        return get()[n];
+    }
+
+    // moving a non-null pointer never makes it null, so arithmetic works on the offset directly
+    offset_ptr &operator+=(difference_type n) noexcept {
+        m_offset += n * static_cast<difference_type>(sizeof(T));
+        return *this;
+    }
+
+    offset_ptr &operator-=(difference_type n) noexcept {
+        m_offset -= n * static_cast<difference_type>(sizeof(T));
+        return *this;
+    }
+
+    offset_ptr &operator++() noexcept {
+        return *this += 1;
+    }
+
+    offset_ptr &operator--() noexcept {
+        return *this -= 1;
+    }
+
+    offset_ptr operator++(int) noexcept {
+        offset_ptr old(*this);
+        ++*this;
+        return old;
+    }
+
+    offset_ptr operator--(int) noexcept {
+        offset_ptr old(*this);
+        --*this;
+        return old;
+    }
+
+    friend offset_ptr operator+(const offset_ptr &p, difference_type n) noexcept {
+        offset_ptr r(p);
+        return r += n;
+    }
+
+    friend offset_ptr operator+(difference_type n, const offset_ptr &p) noexcept {
+        offset_ptr r(p);
+        return r += n;
+    }
+
+    friend offset_ptr operator-(const offset_ptr &p, difference_type n) noexcept {
+        offset_ptr r(p);
+        return r -= n;
+    }
+
+    friend difference_type operator-(const offset_ptr &a, const offset_ptr &b) noexcept {
+        return a.get() - b.get();
+    }
+
+    friend bool operator==(const offset_ptr &a, const offset_ptr &b) noexcept {
+        return a.get() == b.get();
+    }
+
+    friend bool operator==(const offset_ptr &a, std::nullptr_t) noexcept {
+        return !a;
+    }
+
+    friend std::strong_ordering operator<=>(const offset_ptr &a, const offset_ptr &b) noexcept {
+        return std::compare_three_way{}(a.get(), b.get());
+    }
+};
+
+#endif
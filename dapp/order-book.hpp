@@ -0,0 +1,618 @@
+#ifndef ORDER_BOOK_H
+#define ORDER_BOOK_H
+
+#include <algorithm>
+#include <bit>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+#include "balance-matrix.hpp"
+#include "memory-arena.hpp"
+#include "offset-ptr.hpp"
+
+////////////////////////////////////////////////////////////////////////////////
+// Price-level ladder order book
+
+namespace perna {
+
+// whether an order on SIDE limited to limit_price can trade at price
+template <side_what SIDE>
+constexpr bool accepts_price(currency_type limit_price, currency_type price) {
+    if constexpr (SIDE == side_what::buy) {
+        return limit_price >= price;
+    } else {
+        return limit_price <= price;
+    }
+}
+
+//  Token exchange order
+struct order_type {
+    id_type id;          // order id provided by the exchange
+    trader_type trader;  // trader id
+    symbol_type symbol;  // instrument's symbol (ticker)
+    side_what side;      // buy or sell
+    currency_type price; // limit price in instrument.quote
+    quantity_type quantity;   // remaining quantity
+
+    bool matches(const order_type &other) const {
+        return accepts(other.price);
+    }
+
+    // whether this order can trade at price
+    bool accepts(currency_type other_price) const {
+        return side == side_what::buy ? accepts_price<side_what::buy>(price, other_price)
+                                      : accepts_price<side_what::sell>(price, other_price);
+    }
+
+    bool is_filled() const {
+        return quantity == 0;
+    }
+};
+
+// Order resting in a book, keeping only what the book does not already know: the symbol and the side come from the
+// book and the side it rests on, and the trader is interned. The full order_type is only built back when a notice
+// or a report needs it.
+struct resting_order_type {
+    id_type id;              // order id provided by the exchange
+    quantity_type quantity;  // remaining quantity
+    currency_type price;     // limit price in instrument.quote
+    account_id_type trader;  // interned trader id
+};
+
+struct price_level_type;
+
+// Resting order, queued behind older orders at the same price.
+// Takes exactly one cache line, which the arena aligns it to, so walking a queue touches one line per order.
+struct alignas(64) order_node_type {
+    resting_order_type order;
+    offset_ptr<order_node_type> prev;   // previous order in time priority
+    offset_ptr<order_node_type> next;   // next order in time priority
+    offset_ptr<price_level_type> level; // level the order is queued at
+};
+
+static_assert(sizeof(order_node_type) == 64, "order node must fit one cache line");
+
+// FIFO queue of all resting orders at one price
+struct price_level_type {
+    offset_ptr<order_node_type> head; // oldest order, first to be filled
+    offset_ptr<order_node_type> tail; // newest order
+    quantity_type quantity; // remaining quantity of all orders in the queue
+    uint64_t count;         // number of orders in the queue
+};
+
+using order_node_allocator_type = arena_allocator<order_node_type, arena_usage_what::order>;
+using price_level_allocator_type = arena_allocator<price_level_type, arena_usage_what::book>;
+
+// One side of the book.
+// Price levels are kept in a contiguous array sorted from worst to best price, so the best level is always the
+// last element: reaching it is O(1), and inserting or removing it never moves the other levels.
+// A level is dropped as soon as its last order is filled or cancelled, so no level is ever empty and walking the
+// levels costs no more than the depth walked.
+// The array is managed by hand rather than by a std::vector, whose every step would go through offset pointers.
+// Entries refer to their level by its offset in the arena, so they move around the array as plain bytes.
+// BETTER(a, b) tells whether price a has priority over price b.
+template <typename BETTER>
+class price_ladder {
+public:
+    // entry of the level array
+    struct level_entry_type {
+        currency_type price;
+        uint64_t level; // offset of the price level in the arena
+    };
+
+private:
+    using level_entry_allocator_type = arena_allocator<level_entry_type, arena_usage_what::book>;
+
+    static constexpr uint64_t INITIAL_CAPACITY = 16;
+
+    level_entry_allocator_type m_allocator;
+    level_entry_allocator_type::pointer m_levels;
+    uint64_t m_size{0};
+    uint64_t m_capacity{0};
+
+    static bool better(currency_type a, currency_type b) {
+        return BETTER{}(a, b);
+    }
+
+    // nodes and levels come from the same arena as the ladder itself
+    memory_arena *arena() const {
+        return m_allocator.get_arena();
+    }
+
+    order_node_allocator_type node_allocator() const {
+        return order_node_allocator_type{m_allocator};
+    }
+
+    price_level_allocator_type level_allocator() const {
+        return price_level_allocator_type{m_allocator};
+    }
+
+    price_level_type *level_of(const level_entry_type &entry) const {
+        return static_cast<price_level_type *>(arena()->at(entry.level));
+    }
+
+    // valid until the array changes
+    level_entry_type *levels() const {
+        return m_levels.get();
+    }
+
+    const level_entry_type &best_entry() const {
+        return levels()[m_size - 1];
+    }
+
+public:
+    explicit price_ladder(memory_arena *arena) : m_allocator(arena) {}
+
+    // Iterates over resting orders in priority order: best price first, oldest first within a price
+    class const_iterator {
+        const price_ladder *m_ladder;
+        uint64_t m_index;
+        const order_node_type *m_node;
+
+    public:
+        const_iterator(const price_ladder *ladder, uint64_t index, const order_node_type *node) :
+            m_ladder(ladder),
+            m_index(index),
+            m_node(node) {}
+
+        const resting_order_type &operator*() const {
+            return m_node->order;
+        }
+
+        const resting_order_type *operator->() const {
+            return &m_node->order;
+        }
+
+        const_iterator &operator++() {
+            m_node = m_node->next.get();
+            while (!m_node && m_index > 0) {
+                --m_index;
+                m_node = m_ladder->level_of(m_ladder->levels()[m_index])->head.get();
+            }
+            return *this;
+        }
+
+        bool operator==(const const_iterator &other) const {
+            return m_node == other.m_node;
+        }
+
+        bool operator!=(const const_iterator &other) const {
+            return m_node != other.m_node;
+        }
+    };
+
+    price_ladder(const price_ladder &) = delete;
+    price_ladder &operator=(const price_ladder &) = delete;
+    price_ladder &operator=(price_ladder &&) = delete;
+
+    price_ladder(price_ladder &&other) noexcept :
+        m_allocator(other.m_allocator),
+        m_levels(other.m_levels),
+        m_size(other.m_size),
+        m_capacity(other.m_capacity) {
+        other.m_levels = nullptr;
+        other.m_size = 0;
+        other.m_capacity = 0;
+    }
+
+    bool empty() const {
+        return m_size == 0;
+    }
+
+    // oldest order at the best price
+    const resting_order_type &best() const {
+        return level_of(best_entry())->head->order;
+    }
+
+    // visit up to n levels, best price first, as f(price, quantity, count)
+    template <typename F>
+    void for_each_level(uint64_t n, F &&f) const {
+        const auto *entries = levels();
+        for (auto i = m_size; i > 0 && n > 0; --i, --n) {
+            const auto *level = level_of(entries[i - 1]);
+            f(entries[i - 1].price, level->quantity, level->count);
+        }
+    }
+
+    const_iterator begin() const {
+        if (empty()) {
+            return end();
+        }
+        return const_iterator(this, m_size - 1, level_of(best_entry())->head.get());
+    }
+
+    const_iterator end() const {
+        return const_iterator(this, 0, nullptr);
+    }
+
+    // Queue order at the back of its price level, creating the level if needed. Returns nullptr, leaving the ladder
+    // as it was, if the arena has no room for them.
+    order_node_type *insert(const resting_order_type &o) {
+        auto storage = node_allocator().allocate(1);
+        auto *level = storage ? find_or_create_level(o.price) : nullptr;
+        if (!level) {
+            node_allocator().deallocate(storage, 1);
+            return nullptr;
+        }
+        auto *node = push_back_node(level, storage.get(), o);
+        level->quantity += o.quantity;
+        ++level->count;
+        return node;
+    }
+
+    // Make sure an order at price can be inserted, growing the array if it is full, so the next insert only fails if
+    // the arena fills up in between. Returns false if the arena has no room for it.
+    bool reserve(currency_type price) {
+        if (find_level(price)) {
+            return arena()->can_allocate({sizeof(order_node_type)});
+        }
+        return (m_size < m_capacity || grow()) &&
+            arena()->can_allocate({sizeof(order_node_type), sizeof(price_level_type)});
+    }
+
+    // Fill up to quantity from the offers in priority order, stopping at the first level whose price accept rejects.
+    // fill(order, quantity) sees every fill before the book changes. The queue of each level is cut once past its
+    // filled orders, and all levels the sweep emptied are dropped from the back of the array together.
+    // Returns the quantity filled.
+    template <typename ACCEPT, typename FILL>
+    quantity_type sweep(quantity_type quantity, ACCEPT &&accept, FILL &&fill) {
+        quantity_type filled = 0;
+        auto nodes = node_allocator();
+        const auto *entries = levels();
+        auto i = m_size;
+        while (i > 0 && filled < quantity) {
+            auto *level = level_of(entries[i - 1]);
+            if (!accept(entries[i - 1].price)) {
+                break;
+            }
+            auto *node = level->head.get();
+            while (node && filled < quantity) {
+                auto exec_quantity = std::min(quantity - filled, node->order.quantity);
+                fill(static_cast<const resting_order_type &>(node->order), exec_quantity);
+                filled += exec_quantity;
+                level->quantity -= exec_quantity;
+                if (exec_quantity < node->order.quantity) {
+                    node->order.quantity -= exec_quantity;
+                    break;
+                }
+                --level->count;
+                auto *next = node->next.get();
+                if (next) {
+                    __builtin_prefetch(next->next.get());
+                }
+                nodes.deallocate(node, 1);
+                node = next;
+            }
+            level->head = node;
+            if (node) {
+                node->prev = nullptr;
+                break;
+            }
+            level->tail = nullptr;
+            --i;
+        }
+        auto emptied = level_allocator();
+        for (auto j = i; j < m_size; ++j) {
+            emptied.deallocate(level_of(entries[j]), 1);
+        }
+        m_size = i;
+        return filled;
+    }
+
+    // remove any resting order from its level, dropping the level once it becomes empty
+    void erase(order_node_type *node) {
+        auto *level = node->level.get();
+        level->quantity -= node->order.quantity;
+        --level->count;
+        if (node->prev) {
+            node->prev->next = node->next;
+        } else {
+            level->head = node->next;
+        }
+        if (node->next) {
+            node->next->prev = node->prev;
+        } else {
+            level->tail = node->prev;
+        }
+        auto price = node->order.price;
+        node_allocator().deallocate(node, 1);
+        if (!level->head) {
+            erase_level(price);
+        }
+    }
+
+    // Allocate the array, the levels and the nodes again from an arena cleared for compaction, best level first and
+    // each level followed by its queue. moved(node) sees every node.
+    template <typename MOVED>
+    void compact(const arena_evacuation_type &old, MOVED &&moved) {
+        const auto *entries = old.moved(levels());
+        m_capacity = m_size ? std::max(INITIAL_CAPACITY, std::bit_ceil(m_size)) : 0;
+        m_levels = m_capacity ? m_allocator.allocate(m_capacity) : nullptr;
+        for (auto i = m_size; i > 0; --i) {
+            const auto *old_level = static_cast<const price_level_type *>(old.at(entries[i - 1].level));
+            auto *level = new (level_allocator().allocate(1).get())
+                price_level_type{nullptr, nullptr, old_level->quantity, old_level->count};
+            for (const auto *old_node = old_level->head.get(); old_node; old_node = old_node->next.get()) {
+                moved(push_back_node(level, node_allocator().allocate(1).get(), old_node->order));
+            }
+            levels()[i - 1] = level_entry_type{entries[i - 1].price, arena()->offset_of(level)};
+        }
+    }
+
+private:
+    // link a node for o, built in storage, at the back of the queue of level, leaving the level totals alone
+    order_node_type *push_back_node(price_level_type *level, order_node_type *storage, const resting_order_type &o) {
+        auto *node = new (storage) order_node_type{o, level->tail, nullptr, level};
+        if (level->tail) {
+            level->tail->next = node;
+        } else {
+            level->head = node;
+        }
+        level->tail = node;
+        return node;
+    }
+
+    // drop the level at price, which just became empty, moving the better levels down over its entry
+    void erase_level(currency_type price) {
+        auto *it = position_of(price);
+        level_allocator().deallocate(level_of(*it), 1);
+        std::copy(it + 1, levels() + m_size, it);
+        --m_size;
+    }
+
+    bool grow() {
+        auto capacity = m_capacity ? 2 * m_capacity : INITIAL_CAPACITY;
+        auto entries = m_allocator.allocate(capacity);
+        if (!entries) {
+            return false;
+        }
+        std::copy_n(levels(), m_size, entries.get());
+        if (m_levels) {
+            m_allocator.deallocate(m_levels, m_capacity);
+        }
+        m_levels = entries;
+        m_capacity = capacity;
+        return true;
+    }
+
+    // entry of the level at price, or where its entry would go
+    level_entry_type *position_of(currency_type price) const {
+        auto *first = levels();
+        auto *last = first + m_size;
+        // most new orders land at or next to the top of the book, so try the back before searching
+        if (first == last || better(price, last[-1].price)) {
+            return last;
+        }
+        if (last[-1].price == price) {
+            return last - 1;
+        }
+        return std::lower_bound(first, last, price,
+            [](const level_entry_type &e, currency_type p) { return better(p, e.price); });
+    }
+
+    price_level_type *find_level(currency_type price) const {
+        const auto *it = position_of(price);
+        return it != levels() + m_size && it->price == price ? level_of(*it) : nullptr;
+    }
+
+    // level at price, created if needed, or nullptr if the arena has no room for it
+    price_level_type *find_or_create_level(currency_type price) {
+        const auto *it = position_of(price);
+        if (it != levels() + m_size && it->price == price) {
+            return level_of(*it);
+        }
+        auto index = static_cast<uint64_t>(it - levels());
+        if (m_size == m_capacity && !grow()) {
+            return nullptr;
+        }
+        auto storage = level_allocator().allocate(1);
+        if (!storage) {
+            return nullptr;
+        }
+        auto *level = new (storage.get()) price_level_type{nullptr, nullptr, 0, 0};
+        auto *entries = levels();
+        std::copy_backward(entries + index, entries + m_size, entries + m_size + 1);
+        entries[index] = level_entry_type{price, arena()->offset_of(level)};
+        ++m_size;
+        return level;
+    }
+};
+
+// Where a resting order is: its node, and the book and side it rests on, which the node itself does not record
+struct order_location_type {
+    order_node_type *node;  // nullptr when there is no such order
+    uint32_t instrument;    // index of the book in INSTRUMENTS
+    side_what side;
+};
+
+// Maps the id of every resting order to its location, so orders can be found without walking the book.
+// Open addressing with linear probing over a power-of-two table allocated from the arena. Order ids are sequential,
+// so Fibonacci hashing spreads them evenly. Removal shifts displaced entries back instead of leaving tombstones.
+// Slots refer to nodes by their offset in the arena, which nodes being cache-line aligned leaves the low 6 bits of
+// free to hold the side and the instrument, so a slot takes 16 bytes and moves around the table as plain bytes.
+class order_index_type {
+public:
+    struct slot_type {
+        id_type id;        // 0 marks an empty slot, the exchange never issues id 0
+        uint64_t location; // offset of the node in the arena, side in bit 0 and instrument in bits 1 to 5
+    };
+
+private:
+
+    static constexpr uint64_t SIDE_BIT = 1;
+    static constexpr int INSTRUMENT_SHIFT = 1;
+    static constexpr uint64_t LOCATION_MASK = alignof(order_node_type) - 1;
+
+    using slot_allocator_type = arena_allocator<slot_type, arena_usage_what::order>;
+
+    static constexpr uint64_t INITIAL_CAPACITY = 1024;
+
+    slot_allocator_type m_allocator;
+    slot_allocator_type::pointer m_slots;
+    uint64_t m_capacity{0};
+    uint64_t m_size{0};
+
+    uint64_t pack(const order_location_type &location) const {
+        return m_allocator.get_arena()->offset_of(location.node) |
+            (static_cast<uint64_t>(location.instrument) << INSTRUMENT_SHIFT) |
+            (location.side == side_what::sell ? SIDE_BIT : 0);
+    }
+
+    order_location_type unpack(uint64_t location) const {
+        auto *node = static_cast<order_node_type *>(m_allocator.get_arena()->at(location & ~LOCATION_MASK));
+        return order_location_type{node, static_cast<uint32_t>((location & LOCATION_MASK) >> INSTRUMENT_SHIFT),
+            (location & SIDE_BIT) ? side_what::sell : side_what::buy};
+    }
+
+    uint64_t home(id_type id) const {
+        return (id * UINT64_C(0x9e3779b97f4a7c15)) >> (64 - std::countr_zero(m_capacity));
+    }
+
+    bool rehash(uint64_t capacity) {
+        auto old_slots = m_slots;
+        auto old_capacity = m_capacity;
+        m_slots = m_allocator.allocate(capacity);
+        if (!m_slots) {
+            m_slots = old_slots;
+            return false;
+        }
+        std::fill_n(m_slots.get(), capacity, slot_type{0, 0});
+        m_capacity = capacity;
+        for (uint64_t i = 0; i < old_capacity; ++i) {
+            if (old_slots[i].id != 0) {
+                auto j = home(old_slots[i].id);
+                while (m_slots[j].id != 0) {
+                    j = (j + 1) & (m_capacity - 1);
+                }
+                m_slots[j] = old_slots[i];
+            }
+        }
+        if (old_slots) {
+            m_allocator.deallocate(old_slots, old_capacity);
+        }
+        return true;
+    }
+
+public:
+    // instruments the low bits of a slot location can tell apart
+    static constexpr uint32_t MAX_INSTRUMENT_COUNT = alignof(order_node_type) >> INSTRUMENT_SHIFT;
+
+    explicit order_index_type(memory_arena *arena) : m_allocator(arena) {}
+
+    uint64_t size() const {
+        return m_size;
+    }
+
+    // make room for count orders at once, so inserting them never rehashes. Returns false if the arena is full.
+    bool reserve(uint64_t count) {
+        return 2 * count <= m_capacity || rehash(std::max(INITIAL_CAPACITY, std::bit_ceil(2 * count)));
+    }
+
+    order_location_type find(id_type id) const {
+        if (id == 0 || m_size == 0) {
+            return order_location_type{nullptr, 0, {}};
+        }
+        for (auto i = home(id);; i = (i + 1) & (m_capacity - 1)) {
+            if (m_slots[i].id == id) {
+                return unpack(m_slots[i].location);
+            }
+            if (m_slots[i].id == 0) {
+                return order_location_type{nullptr, 0, {}};
+            }
+        }
+    }
+
+    // Returns false if the table had to grow and the arena is full
+    bool insert(id_type id, const order_location_type &location) {
+        // keep load factor at or below 1/2 so probe sequences stay short
+        if (2 * (m_size + 1) > m_capacity && !rehash(m_capacity ? 2 * m_capacity : INITIAL_CAPACITY)) {
+            return false;
+        }
+        auto i = home(id);
+        while (m_slots[i].id != 0) {
+            i = (i + 1) & (m_capacity - 1);
+        }
+        m_slots[i] = slot_type{id, pack(location)};
+        ++m_size;
+        return true;
+    }
+
+    void erase(id_type id) {
+        if (id == 0 || m_size == 0) {
+            return;
+        }
+        auto mask = m_capacity - 1;
+        auto i = home(id);
+        while (m_slots[i].id != id) {
+            if (m_slots[i].id == 0) {
+                return;
+            }
+            i = (i + 1) & mask;
+        }
+        // shift back following entries that were displaced past the freed slot
+        for (auto j = (i + 1) & mask; m_slots[j].id != 0; j = (j + 1) & mask) {
+            auto h = home(m_slots[j].id);
+            if (((j - h) & mask) >= ((j - i) & mask)) {
+                m_slots[i] = m_slots[j];
+                i = j;
+            }
+        }
+        m_slots[i] = slot_type{0, 0};
+        --m_size;
+    }
+
+    // Start over with an empty table from an arena cleared for compaction, as small as the orders about to be
+    // inserted back allow. The cleared arena has room for whatever the arena held before.
+    void compact() {
+        auto size = m_size;
+        m_slots = nullptr;
+        m_capacity = 0;
+        m_size = 0;
+        if (size != 0) {
+            (void) rehash(std::max(INITIAL_CAPACITY, std::bit_ceil(2 * size)));
+        }
+    }
+};
+
+using bids_type = price_ladder<std::greater<currency_type>>;
+using asks_type = price_ladder<std::less<currency_type>>;
+
+struct book_type {
+    symbol_type symbol;
+    bids_type bids;
+    asks_type asks;
+
+    book_type(const symbol_type &symbol, memory_arena *arena) : symbol(symbol), bids(arena), asks(arena) {}
+};
+
+// side of the book an order on SIDE trades against
+template <side_what SIDE>
+using offers_type = std::conditional_t<SIDE == side_what::buy, asks_type, bids_type>;
+
+template <side_what SIDE>
+offers_type<SIDE> &offers_of(book_type &book) {
+    if constexpr (SIDE == side_what::buy) {
+        return book.asks;
+    } else {
+        return book.bids;
+    }
+}
+
+// side of the book an order on SIDE rests on
+template <side_what SIDE>
+using resting_type = std::conditional_t<SIDE == side_what::buy, bids_type, asks_type>;
+
+template <side_what SIDE>
+resting_type<SIDE> &resting_of(book_type &book) {
+    if constexpr (SIDE == side_what::buy) {
+        return book.bids;
+    } else {
+        return book.asks;
+    }
+}
+
+} // namespace perna
+
+#endif
@@ -0,0 +1,224 @@
+#ifndef STATE_EXPORT_H
+#define STATE_EXPORT_H
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// Compact export of the state of the exchange, to bring up a node without replaying every input
+
+// An export holds what the lambda means rather than how its arena happens to be laid out, so it leaves out the free
+// blocks and spare capacity of the containers, and importing it builds a freshly packed arena. After the header come
+// plain arrays, each padded to 8 bytes, so every one of them can be used in place:
+//   symbols     instrument_count symbol_type, the instrument table of the build that made the export
+//   tokens      token_count eth_address, in token id order
+//   traders     trader_count eth_address, in account id order
+//   balances    trader_count rows of currency_type, one for each token of the instruments
+//   others      other_balance_count account ids, then as many token ids and amounts, the nonzero balances in every
+//               other token
+//   book sizes  instrument_count pairs of uint64_t, orders resting on the bids and on the asks of each book
+//   orders      order_count ids, then as many account ids, prices and quantities, book by book with the bids of each
+//               book ahead of its asks, every side in priority order
+// Numbers are in host byte order, as in the lambda itself.
+
+// "PERNASTA" read as a little-endian integer
+constexpr uint64_t STATE_EXPORT_MAGIC = UINT64_C(0x415453414e524550);
+
+// Bumped whenever the columns change
+constexpr uint32_t STATE_EXPORT_VERSION = 2;
+
+struct state_export_header_type {
+    uint64_t magic;               // STATE_EXPORT_MAGIC
+    uint32_t version;             // STATE_EXPORT_VERSION
+    uint32_t instrument_count;    // entries of the instrument table
+    uint32_t token_count;         // tokens interned
+    uint32_t trader_count;        // traders interned
+    uint64_t order_count;         // orders resting in every book
+    uint64_t other_balance_count; // balances in tokens other than those of the instruments
+    uint64_t next_id;             // last order id handed out
+    uint64_t epoch_index;         // epoch of the last advance input taken
+    uint64_t input_count;         // advance inputs taken
+};
+
+// Writes an export to a file column by column through a buffer. The export replaces the file only once it is whole.
+class state_export_writer_type {
+    static constexpr size_t BUFFER_LENGTH = 1 << 20;
+
+    std::string m_filename;
+    std::string m_new_filename;
+    int m_fd{-1};
+    std::vector<unsigned char> m_buffer;
+    size_t m_used{0};
+    uint64_t m_written{0};
+    bool m_failed{false};
+
+    void drain() {
+        for (size_t done = 0; done < m_used && !m_failed;) {
+            auto n = write(m_fd, m_buffer.data() + done, m_used - done);
+            if (n < 0) {
+                (void) fprintf(stderr, "[dapp] unable to write state export (%s)\n", strerror(errno));
+                m_failed = true;
+            } else {
+                done += static_cast<size_t>(n);
+            }
+        }
+        m_used = 0;
+    }
+
+public:
+    state_export_writer_type() = default;
+    state_export_writer_type(const state_export_writer_type &) = delete;
+    state_export_writer_type &operator=(const state_export_writer_type &) = delete;
+
+    ~state_export_writer_type() {
+        if (m_fd >= 0) {
+            ::close(m_fd);
+            (void) unlink(m_new_filename.c_str());
+        }
+    }
+
+    // Start an export to filename, written next to it until it is whole
+    bool open(const char *filename) {
+        m_filename = filename;
+        m_new_filename = m_filename + ".new";
+        m_fd = ::open(m_new_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (m_fd < 0) {
+            (void) fprintf(stderr, "[dapp] unable to create state export '%s' (%s)\n", m_new_filename.c_str(),
+                strerror(errno));
+            return false;
+        }
+        m_buffer.resize(BUFFER_LENGTH);
+        return true;
+    }
+
+    void write_bytes(const void *data, size_t length) {
+        const auto *bytes = static_cast<const unsigned char *>(data);
+        while (length > 0) {
+            if (m_used == BUFFER_LENGTH) {
+                drain();
+            }
+            auto n = std::min(length, BUFFER_LENGTH - m_used);
+            std::memcpy(m_buffer.data() + m_used, bytes, n);
+            m_used += n;
+            m_written += n;
+            bytes += n;
+            length -= n;
+        }
+    }
+
+    // one more entry of the column being written
+    template <typename T>
+    void append(const T &value) {
+        write_bytes(&value, sizeof(value));
+    }
+
+    // a whole column at once
+    template <typename T>
+    void append(const T *values, size_t count) {
+        write_bytes(values, count * sizeof(T));
+    }
+
+    // pad the column just written, so the next one starts 8-byte aligned
+    void end_column() {
+        static constexpr unsigned char padding[8]{};
+        write_bytes(padding, (8 - m_written % 8) % 8);
+    }
+
+    // Make the export durable and put it in place of the file, if every write succeeded
+    bool close() {
+        drain();
+        bool ok = !m_failed;
+        if (ok && fsync(m_fd) < 0) {
+            (void) fprintf(stderr, "[dapp] unable to sync state export (%s)\n", strerror(errno));
+            ok = false;
+        }
+        ::close(m_fd);
+        m_fd = -1;
+        if (ok && rename(m_new_filename.c_str(), m_filename.c_str()) < 0) {
+            (void) fprintf(stderr, "[dapp] unable to put state export in place (%s)\n", strerror(errno));
+            ok = false;
+        }
+        if (!ok) {
+            (void) unlink(m_new_filename.c_str());
+        }
+        return ok;
+    }
+};
+
+// Maps an export read-only and hands out its columns in order, where they lie in the mapping
+class state_export_reader_type {
+    const unsigned char *m_data{nullptr};
+    size_t m_length{0};
+    size_t m_offset{0};
+
+public:
+    state_export_reader_type() = default;
+    state_export_reader_type(const state_export_reader_type &) = delete;
+    state_export_reader_type &operator=(const state_export_reader_type &) = delete;
+
+    ~state_export_reader_type() {
+        if (m_data) {
+            munmap(const_cast<unsigned char *>(m_data), m_length);
+        }
+    }
+
+    bool open(const char *filename) {
+        int fd = ::open(filename, O_RDONLY);
+        if (fd < 0) {
+            (void) fprintf(stderr, "[dapp] unable to open state export '%s' (%s)\n", filename, strerror(errno));
+            return false;
+        }
+        struct stat st {};
+        if (fstat(fd, &st) < 0 || st.st_size == 0) {
+            (void) fprintf(stderr, "[dapp] state export '%s' is empty\n", filename);
+            close(fd);
+            return false;
+        }
+        auto length = static_cast<size_t>(st.st_size);
+        auto *data = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED) {
+            (void) fprintf(stderr, "[dapp] unable to map state export (%s)\n", strerror(errno));
+            return false;
+        }
+        // columns are read front to back, once
+        (void) madvise(data, length, MADV_SEQUENTIAL);
+        m_data = static_cast<const unsigned char *>(data);
+        m_length = length;
+        return true;
+    }
+
+    // bytes of the export
+    size_t get_length() const {
+        return m_length;
+    }
+
+    // next column of count entries, or nullptr if the export ends before it does
+    template <typename T>
+    const T *column(uint64_t count) {
+        if (count > (m_length - m_offset) / sizeof(T)) {
+            return nullptr;
+        }
+        const auto *values = reinterpret_cast<const T *>(m_data + m_offset);
+        m_offset += count * sizeof(T);
+        m_offset = std::min(m_length, (m_offset + 7) & ~size_t{7});
+        return values;
+    }
+
+    bool at_end() const {
+        return m_offset == m_length;
+    }
+};
+
+#endif
@@ -0,0 +1,250 @@
+// Side-by-side benchmark of the price-level ladder book against the std::multiset book it replaced.
+//
+// Both books allocate from the same kind of memory_arena the dapp uses. For each depth, the benchmark
+//   - builds a book with that many resting asks spread over a fixed number of price levels (insert),
+//   - then repeatedly inserts one more ask and fills the best ask with an aggressive buy (churn),
+//   - and finally sweeps the whole book with aggressive buys that each fill several orders (sweep).
+// The ladder runs a second time with the arena compacted between the churn and the sweep.
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <set>
+#include <type_traits>
+#include <vector>
+
+#include <sys/mman.h>
+
+#include "io-types.h"
+#include "memory-arena.hpp"
+#include "order-book.hpp"
+
+namespace multiset_book {
+
+using perna::order_type;
+
+// comparator for sorting bid offers
+struct best_bid {
+    bool operator()(const order_type &a, const order_type &b) const {
+        return a.price > b.price;
+    }
+};
+
+// comparator for sortting ask offers
+struct best_ask {
+    bool operator()(const order_type &a, const order_type &b) const {
+        return a.price < b.price;
+    }
+};
+
+// std::multiset does not take offset pointers, so it draws from the arena through plain pointers
+template <typename T>
+class raw_arena_allocator {
+    memory_arena *m_arena;
+
+public:
+    using value_type = T;
+
+    explicit raw_arena_allocator(memory_arena *arena) : m_arena(arena) {}
+
+    template <typename U>
+    raw_arena_allocator(const raw_arena_allocator<U> &other) : m_arena(other.get_arena()) {}
+
+    memory_arena *get_arena() const {
+        return m_arena;
+    }
+
+    T *allocate(std::size_t n) {
+        return static_cast<T *>(m_arena->allocate(n * sizeof(T)));
+    }
+
+    void deallocate(T *p, std::size_t n) noexcept {
+        m_arena->deallocate(p, n * sizeof(T));
+    }
+
+    template <typename U>
+    bool operator==(const raw_arena_allocator<U> &other) const {
+        return m_arena == other.get_arena();
+    }
+};
+
+using bids_type = std::multiset<order_type, best_bid, raw_arena_allocator<order_type>>;
+using asks_type = std::multiset<order_type, best_ask, raw_arena_allocator<order_type>>;
+
+} // namespace multiset_book
+
+constexpr uint64_t ARENA_LENGTH = UINT64_C(8) << 30;
+constexpr currency_type BASE_PRICE = 10000;
+
+// Empty book of either kind, allocating from arena
+template <typename ASKS>
+static ASKS make_asks(memory_arena *arena) {
+    if constexpr (std::is_same_v<ASKS, multiset_book::asks_type>) {
+        return ASKS(multiset_book::raw_arena_allocator<perna::order_type>{arena});
+    } else {
+        return ASKS(arena);
+    }
+}
+
+// Uniform access to the best offer in either kind of book
+static const perna::order_type &best_of(const multiset_book::asks_type &asks) {
+    return *asks.begin();
+}
+
+static const perna::resting_order_type &best_of(const perna::asks_type &asks) {
+    return asks.best();
+}
+
+static void insert_into(multiset_book::asks_type &asks, const perna::order_type &o) {
+    asks.insert(o);
+}
+
+// the ladder keeps only what the book does not know, as the exchange does
+static void insert_into(perna::asks_type &asks, const perna::order_type &o) {
+    asks.insert(perna::resting_order_type{o.id, o.quantity, o.price, 0});
+}
+
+static void fill_best_of(multiset_book::asks_type &asks, quantity_type quantity) {
+    // ok to drop const becasue the set is ordered by a custom comparator whose key(price) won't be changed
+    const_cast<perna::order_type &>(*asks.begin()).quantity -= quantity;
+}
+
+static void erase_best_of(multiset_book::asks_type &asks) {
+    asks.erase(asks.begin());
+}
+
+// Aggressive buy against the multiset, one fill at a time
+template <typename ASKS>
+static uint64_t buy(ASKS &asks, perna::order_type o) {
+    uint64_t fills = 0;
+    while (!asks.empty()) {
+        auto &best_offer = best_of(asks);
+        if (o.is_filled() || !o.matches(best_offer)) {
+            break;
+        }
+        auto exec_quantity = std::min(o.quantity, best_offer.quantity);
+        o.quantity -= exec_quantity;
+        fill_best_of(asks, exec_quantity);
+        ++fills;
+        if (best_offer.is_filled()) {
+            erase_best_of(asks);
+        }
+    }
+    return fills;
+}
+
+// Aggressive buy against the ladder, sweeping all fills at once as exchange::match does
+static uint64_t buy(perna::asks_type &asks, const perna::order_type &o) {
+    uint64_t fills = 0;
+    asks.sweep(o.quantity, [&](currency_type price) { return o.accepts(price); },
+        [&](const perna::resting_order_type &, quantity_type) { ++fills; });
+    return fills;
+}
+
+struct result_type {
+    double insert_ns;
+    double churn_ns;
+    double sweep_ns;
+};
+
+static double ns_per(std::chrono::steady_clock::duration d, uint64_t n) {
+    return static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(d).count()) /
+        static_cast<double>(std::max<uint64_t>(n, 1));
+}
+
+template <typename ASKS>
+static result_type run(memory_arena *arena, uint64_t depth, uint64_t levels, uint64_t churns, bool compact = false) {
+    new (arena) memory_arena(ARENA_LENGTH);
+    std::mt19937_64 rng(depth * 31 + levels);
+    std::uniform_int_distribution<currency_type> price(BASE_PRICE, BASE_PRICE + levels - 1);
+    std::uniform_int_distribution<quantity_type> quantity(1, 100);
+    std::vector<perna::order_type> resting(depth + churns);
+    for (uint64_t i = 0; i < resting.size(); ++i) {
+        resting[i] = perna::order_type{.id = i + 1,
+            .trader = {},
+            .symbol = symbol_type{"CTSI/USDT"},
+            .side = side_what::sell,
+            .price = price(rng),
+            .quantity = quantity(rng)};
+    }
+    result_type r{};
+    auto asks = make_asks<ASKS>(arena);
+    auto start = std::chrono::steady_clock::now();
+    for (uint64_t i = 0; i < depth; ++i) {
+        insert_into(asks, resting[i]);
+    }
+    r.insert_ns = ns_per(std::chrono::steady_clock::now() - start, depth);
+    perna::order_type taker{
+        .id = 0, .trader = {}, .symbol = symbol_type{"CTSI/USDT"}, .side = side_what::buy, .price = 0, .quantity = 0};
+    start = std::chrono::steady_clock::now();
+    for (uint64_t i = depth; i < depth + churns; ++i) {
+        insert_into(asks, resting[i]);
+        taker.price = best_of(asks).price;
+        taker.quantity = best_of(asks).quantity;
+        buy(asks, taker);
+    }
+    r.churn_ns = ns_per(std::chrono::steady_clock::now() - start, churns);
+    if constexpr (std::is_same_v<ASKS, perna::asks_type>) {
+        if (compact) {
+            // the book stays as it was if there is no memory to copy the arena
+            arena_evacuation_type old(arena);
+            if (old.evacuate()) {
+                asks.compact(old, [](perna::order_node_type *) {});
+            }
+        }
+    }
+    uint64_t fills = 0;
+    taker.price = BASE_PRICE + levels;
+    taker.quantity = 400;
+    start = std::chrono::steady_clock::now();
+    while (!asks.empty()) {
+        fills += buy(asks, taker);
+    }
+    r.sweep_ns = ns_per(std::chrono::steady_clock::now() - start, fills);
+    return r;
+}
+
+int main(int argc, char *argv[]) {
+    uint64_t levels = 512;
+    uint64_t churns = 100000;
+    int end = 0;
+    for (int i = 1; i < argc; ++i) {
+        end = 0;
+        if (sscanf(argv[i], "--levels=%" SCNu64 "%n", &levels, &end) == 1 && argv[i][end] == 0) {
+            ;
+        } else if (sscanf(argv[i], "--churns=%" SCNu64 "%n", &churns, &end) == 1 && argv[i][end] == 0) {
+            ;
+        } else {
+            (void) fprintf(stderr, "[bench] invalid argument '%s'\n", argv[i]);
+            return 1;
+        }
+    }
+    auto *arena = static_cast<memory_arena *>(
+        mmap(nullptr, ARENA_LENGTH, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0));
+    if (arena == MAP_FAILED) {
+        (void) fprintf(stderr, "[bench] mmap failed (%s)\n", strerror(errno));
+        return 1;
+    }
+    (void) printf("%" PRIu64 " price levels, %" PRIu64 " churns, times in ns per operation\n", levels, churns);
+    (void) printf("%8s  %-9s %10s %10s %10s\n", "depth", "book", "insert", "churn", "sweep/fill");
+    for (uint64_t depth : {UINT64_C(1000), UINT64_C(10000), UINT64_C(100000), UINT64_C(1000000)}) {
+        auto m = run<multiset_book::asks_type>(arena, depth, levels, churns);
+        auto l = run<perna::asks_type>(arena, depth, levels, churns);
+        auto c = run<perna::asks_type>(arena, depth, levels, churns, true);
+        (void) printf("%8" PRIu64 "  %-9s %10.1f %10.1f %10.1f\n", depth, "multiset", m.insert_ns, m.churn_ns,
+            m.sweep_ns);
+        (void) printf("%8" PRIu64 "  %-9s %10.1f %10.1f %10.1f\n", depth, "ladder", l.insert_ns, l.churn_ns,
+            l.sweep_ns);
+        (void) printf("%8" PRIu64 "  %-9s %10.1f %10.1f %10.1f\n", depth, "compacted", c.insert_ns, c.churn_ns,
+            c.sweep_ns);
+    }
+    munmap(arena, ARENA_LENGTH);
+    return 0;
+}
@@ -8,9 +8,8 @@
 #include <exception>
 #include <iomanip>
 #include <iostream>
-#include <map>
-#include <set>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include <fcntl.h>
@@ -18,293 +17,748 @@
 #include <sys/mman.h>
 #include <unistd.h>
 
-constexpr uint64_t LAMBDA_VIRTUAL_START = UINT64_C(0x1000000000); // something that worked
-
 ////////////////////////////////////////////////////////////////////////////////
 // Input/output types for advance/inspect state and voucher/notice/report
 #include "io-types.h"
 
+struct rollup_state_type;
+
 ////////////////////////////////////////////////////////////////////////////////
-// Perna's exchange
+// Heap-free advance path
+
+// Execution notices caused by the input being processed.
+// They go into one fixed buffer reused by every input, so processing an input never touches the heap. When the buffer
+// fills up, the notices in it are handed to the writer to make room. Nothing else is written while an order is being
+// matched, so notices still come out in the order they were made.
+class execution_notices_type {
+public:
+    using writer_type = void (*)(rollup_state_type *rollup_state, const execution_notice_type *notices, size_t count);
+
+    // a whole number of execution batch notices, so flushing early never splits a batch
+    static constexpr size_t CAPACITY = 8 * MAX_EXECUTION_BATCH_ENTRY;
 
-class memory_arena {
-    uint64_t m_length;
-    uint64_t m_next_free;
-    unsigned char m_data[0];
+private:
+    rollup_state_type *m_rollup_state{nullptr};
+    writer_type m_writer{nullptr};
+    size_t m_size{0};
+    std::array<execution_notice_type, CAPACITY> m_entries;
 
 public:
-    memory_arena(uint64_t length) : m_length(length), m_next_free(0) {}
-    void *get_data() {
-        return m_data;
+    // start collecting the notices of an input, to be written out by writer
+    void open(rollup_state_type *rollup_state, writer_type writer) {
+        m_rollup_state = rollup_state;
+        m_writer = writer;
+        m_size = 0;
     }
 
-    void *allocate(int length) {
-        volatile void *p =  m_data + m_next_free;
-        if ((m_next_free + length) > get_data_length()) {
-            return nullptr;
+    void push_back(const execution_notice_type &notice) {
+        if (m_size == CAPACITY) {
+            flush();
         }
-        m_next_free += length;
-        return const_cast<void*>(p);
+        m_entries[m_size++] = notice;
     }
 
-    void deallocate(void *p, int length) {}
-
-    uint64_t get_data_length() {
-        return m_length - offsetof(memory_arena, m_data);
+    // write out the notices collected so far
+    void flush() {
+        if (m_size != 0) {
+            m_writer(m_rollup_state, m_entries.data(), m_size);
+            m_size = 0;
+        }
     }
 };
 
-// Global arena shared by all instances of arena_allocator
-static memory_arena *g_arena;
+// Buffer for the execution notices of the input being processed
+static execution_notices_type &open_execution_notices(rollup_state_type *rollup_state,
+    execution_notices_type::writer_type writer) {
+    static execution_notices_type notices;
+    notices.open(rollup_state, writer);
+    return notices;
+}
+
+#ifdef ALLOCATION_AUDIT
+// Audit builds count every heap allocation and abort on the first input whose processing made any.
+// Every allocation function of the C library is interposed, including the obsolete aligned ones. operator new goes
+// through them as well, the aligned forms through aligned_alloc, posix_memalign or memalign depending on how the C++
+// library was built.
+static uint64_t allocation_count = 0;
+
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *p, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+void *__libc_valloc(size_t size);
+void *__libc_pvalloc(size_t size);
+
+void *malloc(size_t size) noexcept {
+    ++allocation_count;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) noexcept {
+    ++allocation_count;
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *p, size_t size) noexcept {
+    ++allocation_count;
+    return __libc_realloc(p, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size) noexcept {
+    ++allocation_count;
+    return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **p, size_t alignment, size_t size) noexcept {
+    ++allocation_count;
+    *p = __libc_memalign(alignment, size);
+    return *p ? 0 : ENOMEM;
+}
+
+void *memalign(size_t alignment, size_t size) noexcept {
+    ++allocation_count;
+    return __libc_memalign(alignment, size);
+}
+
+void *valloc(size_t size) noexcept {
+    ++allocation_count;
+    return __libc_valloc(size);
+}
+
+void *pvalloc(size_t size) noexcept {
+    ++allocation_count;
+    return __libc_pvalloc(size);
+}
+}
+
+// Aborts if any heap allocation is made during its lifetime
+class allocation_audit_type {
+    uint64_t m_start;
 
-template <typename T>
-class arena_allocator {
 public:
-    arena_allocator() = default;
-    using pointer = T *;
-    using value_type = T;
-    pointer allocate(std::size_t n) {
-        return static_cast<pointer>(g_arena->allocate(n * sizeof(T)));
+    allocation_audit_type() : m_start(allocation_count) {}
+
+    allocation_audit_type(const allocation_audit_type &) = delete;
+    allocation_audit_type &operator=(const allocation_audit_type &) = delete;
+
+    ~allocation_audit_type() {
+        if (allocation_count != m_start) {
+            (void) fprintf(stderr, "[dapp] input made %" PRIu64 " heap allocations\n", allocation_count - m_start);
+            abort();
+        }
     }
-    void deallocate(pointer p, std::size_t n) noexcept {
-        g_arena->deallocate(p, n * sizeof(T));
+};
+
+// Leaves the allocations made during its lifetime out of the audit, for maintenance that is allowed to allocate
+class allocation_audit_exemption_type {
+    uint64_t m_start;
+
+public:
+    allocation_audit_exemption_type() : m_start(allocation_count) {}
+
+    allocation_audit_exemption_type(const allocation_audit_exemption_type &) = delete;
+    allocation_audit_exemption_type &operator=(const allocation_audit_exemption_type &) = delete;
+
+    ~allocation_audit_exemption_type() {
+        allocation_count = m_start;
     }
 };
+#else
+struct allocation_audit_type {};
+struct allocation_audit_exemption_type {};
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+// Perna's exchange
+
+#include "balance-matrix.hpp"
+#include "instruments.hpp"
+#include "memory-arena.hpp"
+#include "order-book.hpp"
+#include "state-export.hpp"
 
 namespace perna {
 
-// Trading instrument
-struct instrument_type {
-    token_type base;  // token being traded
-    token_type quote; // quote token - "price " of 1 base token
+// one book per instrument, in the same order as INSTRUMENTS
+using books_type = std::array<book_type, INSTRUMENT_COUNT>;
+
+static_assert(INSTRUMENT_COUNT <= order_index_type::MAX_INSTRUMENT_COUNT, "order index cannot locate every book");
+
+// Balance slots of one trader for the base and quote tokens of an instrument, with the credits still to be applied
+struct account_type {
+    trader_type trader;
+    account_id_type account;
+    balance_matrix_type::slot_type base;
+    balance_matrix_type::slot_type quote;
+    currency_type base_credit;
+    currency_type quote_credit;
 };
 
-//  Token exchange order
-struct order_type {
-    id_type id;          // order id provided by the exchange
-    trader_type trader;  // trader id
-    symbol_type symbol;  // instrument's symbol (ticker)
-    side_what side;      // buy or sell
-    currency_type price; // limit price in instrument.quote
-    quantity_type quantity;   // remaining quantity
+// Net balance changes caused by the fills of one incoming order.
+// The balance slots of each party are resolved once per run of fills against it, and credits are accumulated while
+// the order sweeps the book. Funds are locked when an order is accepted, so fills only ever credit balances, and a
+// maker is credited as soon as the sweep moves on to another one. Only the taker and the current maker are kept, so
+// settling never allocates however many makers are filled.
+class settlement_type {
+    account_type m_taker;
+    account_type m_maker;
+    bool m_has_maker{false};
 
-    bool matches(const order_type &other) {
-        return (side == side_what::buy && price >= other.price) || (side == side_what::sell && price <= other.price);
-    }
+public:
+    explicit settlement_type(const account_type &taker) : m_taker(taker), m_maker{} {}
 
-    bool is_filled() {
-        return quantity == 0;
+    account_type &taker() {
+        return m_taker;
     }
-};
 
-// comparator for sorting bid offers
-struct best_bid {
-    bool operator()(const order_type &a, const order_type &b) const {
-        return a.price > b.price;
+    // account of the maker of the offer being filled, if the previous fill was against the same trader
+    account_type *find_maker(account_id_type account) {
+        if (m_has_maker && m_maker.account == account) {
+            return &m_maker;
+        }
+        return nullptr;
     }
-};
 
-// comparator for sortting ask offers
-struct best_ask {
-    bool operator()(const order_type &a, const order_type &b) const {
-        return a.price < b.price;
+    // credit the current maker and move on to the next one
+    account_type &add_maker(balance_matrix_type &balances, const account_type &maker) {
+        if (m_has_maker) {
+            credit(balances, m_maker);
+        }
+        m_maker = maker;
+        m_has_maker = true;
+        return m_maker;
     }
-};
 
-using bids_type = std::multiset<order_type, best_bid, arena_allocator<order_type>>;
-using asks_type = std::multiset<order_type, best_ask, arena_allocator<order_type>>;
+    void apply(balance_matrix_type &balances) {
+        credit(balances, m_taker);
+        if (m_has_maker) {
+            credit(balances, m_maker);
+        }
+    }
 
-struct book_type {
-    symbol_type symbol;
-    bids_type bids;
-    asks_type asks;
+private:
+    static void credit(balance_matrix_type &balances, account_type &account) {
+        balances[account.base] += account.base_credit;
+        balances[account.quote] += account.quote_credit;
+        account.base_credit = 0;
+        account.quote_credit = 0;
+    }
 };
 
-using wallet_type = std::map<token_type, currency_type, std::less<token_type>,
-    arena_allocator<std::pair<const token_type, currency_type>>>;
-using books_type =
-    std::map<symbol_type, book_type, std::less<symbol_type>, arena_allocator<std::pair<const symbol_type, book_type>>>;
-using wallets_type = std::map<trader_type, wallet_type, std::less<trader_type>,
-    arena_allocator<std::pair<const trader_type, wallet_type>>>;
-using instruments_type = std::map<symbol_type, instrument_type, std::less<symbol_type>,
-    arena_allocator<std::pair<const symbol_type, instrument_type>>>;
-
 // exchange class to be "deserialized" from lambda state
+// Every container allocates from the arena given to the constructor.
 class exchange {
-    instruments_type instruments;
     books_type books;
-    wallets_type wallets;
+    address_directory_type traders;
+    address_directory_type tokens;
+    balance_matrix_type balances;
+    order_index_type orders;
     id_type next_id{0};
 
 public:
-    exchange() {
-        instruments[symbol_type{"ADA/USDT"}] = instrument_type{ADA_ADDRESS, USDT_ADDRESS};
-        instruments[symbol_type{"BNB/USDT"}] = instrument_type{BNB_ADDRESS, USDT_ADDRESS};
-        instruments[symbol_type{"BTC/USDT"}] = instrument_type{BTC_ADDRESS, USDT_ADDRESS};
-        instruments[symbol_type{"CTSI/USDT"}] = instrument_type{CTSI_ADDRESS, USDT_ADDRESS};
-        instruments[symbol_type{"DAI/USDT"}] = instrument_type{DAI_ADDRESS, USDT_ADDRESS};
-        instruments[symbol_type{"DOGE/USDT"}] = instrument_type{DOGE_ADDRESS, USDT_ADDRESS};
-        instruments[symbol_type{"SOL/USDT"}] = instrument_type{SOL_ADDRESS, USDT_ADDRESS};
-        instruments[symbol_type{"TON/USDT"}] = instrument_type{TON_ADDRESS, USDT_ADDRESS};
-        instruments[symbol_type{"XRP/USDT"}] = instrument_type{XRP_ADDRESS, USDT_ADDRESS};
-        instruments[symbol_type{"ADA/BTC"}] = instrument_type{ADA_ADDRESS, BTC_ADDRESS };
-        instruments[symbol_type{"BNB/BTC"}] = instrument_type{BNB_ADDRESS, BTC_ADDRESS };
-        instruments[symbol_type{"CTSI/BTC"}] = instrument_type{CTSI_ADDRESS, BTC_ADDRESS };
-        instruments[symbol_type{"XRP/BTC"}] = instrument_type{XRP_ADDRESS, BTC_ADDRESS };
-    }
-
-    bool new_order(order_type o, execution_notices_type &reports) {
+    explicit exchange(memory_arena *arena) :
+        books(make_books(arena, std::make_index_sequence<INSTRUMENT_COUNT>{})),
+        traders(arena),
+        tokens(arena),
+        balances(arena, INSTRUMENT_TOKEN_COUNT),
+        orders(arena) {
+        // intern instrument tokens first, so their ids match INSTRUMENTS and their balances are kept in rows
+        for (const auto &token : INSTRUMENT_TOKENS) {
+            tokens.intern(token);
+        }
+    }
+
+    bool new_order(order_type o, order_kind_what kind, time_in_force_what time_in_force,
+        execution_notices_type &reports) {
         // validate order
-        auto instrument = instruments.find(o.symbol);
-        if (instrument == instruments.end()) {
+        const auto *instrument = find_instrument(o.symbol);
+        if (!instrument) {
             reports.push_back({o.trader, event_what::rejection_invalid_symbol, o.id, o.symbol, o.side, o.quantity, o.price});
             return false;
         }
+        // everything from here on depends on the side, so pick it once
         if (o.side == side_what::buy) {
-            auto size = (o.quantity * o.price) / 100;
-            auto balance = get_balance(o.trader, instrument->second.quote);
-            if (balance < size) {
-                reports.push_back(
-                    {o.trader, event_what::rejection_insufficient_funds, o.id, o.symbol, o.side, o.quantity, o.price});
-                return false;
-            }
-            subtract_from_balance(o.trader, instrument->second.quote, size);
-        } else {
-            auto size = o.quantity;
-            auto balance = get_balance(o.trader, instrument->second.base);
-            if (balance < size) {
-                reports.push_back(
-                    {o.trader, event_what::rejection_insufficient_funds, o.id, o.symbol, o.side, o.quantity, o.price});
-                return false;
-            }
-            subtract_from_balance(o.trader, instrument->second.base, size);
+            return place_order<side_what::buy>(o, *instrument, kind, time_in_force, reports);
         }
-        // send report acknowledging new order
-        reports.push_back({o.trader, event_what::new_order, get_next_id(), o.symbol, o.side, o.quantity, o.price});
-        // match against existing orders
-        auto &book = find_or_create_book(o.symbol);
-        if (o.side == side_what::buy) {
-            match(o, book.asks, instrument->second, reports);
-            if (!o.is_filled()) {
-                book.bids.insert(o);
-            }
+        return place_order<side_what::sell>(o, *instrument, kind, time_in_force, reports);
+    }
+
+    bool cancel_order(const trader_type &trader, id_type id, execution_notices_type &reports) {
+        // only the trader who placed a resting order can cancel it
+        auto location = orders.find(id);
+        if (!location.node || traders.address(location.node->order.trader) != trader) {
+            reports.push_back({trader, event_what::rejection_invalid_id, id, {}, {}, 0, 0});
+            return false;
+        }
+        auto o = location.node->order;
+        const auto &instrument = INSTRUMENTS[location.instrument];
+        auto &book = books[location.instrument];
+        // release funds locked by the remaining quantity
+        if (location.side == side_what::buy) {
+            balances.at(o.trader, instrument.quote_id) += (o.quantity * o.price) / 100;
+            book.bids.erase(location.node);
         } else {
-            match(o, book.bids, instrument->second, reports);
-            if (!o.is_filled()) {
-                book.asks.insert(o);
-            }
+            balances.at(o.trader, instrument.base_id) += o.quantity;
+            book.asks.erase(location.node);
         }
+        orders.erase(id);
+        reports.push_back(
+            {trader, event_what::cancel_order, o.id, instrument.symbol, location.side, o.quantity, o.price});
         return true;
     }
 
-    wallet_type *find_wallet(const trader_type &trader) {
-        auto it = wallets.find(trader);
-        if (it != wallets.end()) {
-            return &it->second;
+    // visit every token the trader holds a nonzero balance of, in token id order
+    template <typename F>
+    void for_each_balance(const trader_type &trader, F &&f) const {
+        auto account = traders.find(trader);
+        if (account == address_directory_type::NO_ID) {
+            return;
+        }
+        for (token_id_type token = 0; token < tokens.size(); ++token) {
+            auto amount = balances.get(account, token);
+            if (amount != 0) {
+                f(tokens.address(token), amount);
+            }
         }
-        return nullptr;
+    }
+
+    // address of the trader a resting order refers to by its interned id
+    const trader_type &trader_address(account_id_type account) const {
+        return traders.address(account);
     }
 
     book_type *find_book(const symbol_type &symbol) {
-        auto it = books.find(symbol);
-        if (it != books.end()) {
-            return &it->second;
+        const auto *instrument = find_instrument(symbol);
+        if (instrument) {
+            return &books[instrument->index];
         }
         return nullptr;
     }
 
-    void deposit(const trader_type &trader, const token_type &token, currency_type amount) {
-        add_to_balance(trader, token, amount);
+    // Returns false if the arena has no room left for a new trader or token
+    bool deposit(const trader_type &trader, const token_type &token, currency_type amount) {
+        auto account = intern_trader(trader);
+        auto id = account == address_directory_type::NO_ID ? account : tokens.intern(token);
+        auto *balance = id == address_directory_type::NO_ID ? nullptr : balances.find_or_add(account, id);
+        if (!balance) {
+            return false;
+        }
+        *balance += amount;
+        return true;
     }
 
     bool withdraw(const trader_type trader, const token_type token, currency_type amount) {
         if (get_balance(trader, token) < amount) {
             return false;
         }
-        subtract_from_balance(trader, token, amount);
+        // a trader only has funds in a token it holds a balance of, so there is nothing to add
+        if (amount != 0) {
+            *balances.find_or_add(traders.find(trader), tokens.find(token)) -= amount;
+        }
+        return true;
+    }
+
+    // Move every block of the exchange to the front of arena, which must be the arena it was constructed with.
+    // The order index comes first, sized for every order and filled again as the nodes move. The books follow, each
+    // ladder with its best level first and every level followed by its queue, and then the directories and balances.
+    // Returns false, leaving the arena as it was, if there is no memory to copy the arena into.
+    bool compact(memory_arena *arena) {
+        arena_evacuation_type old(arena);
+        if (!old.evacuate()) {
+            return false;
+        }
+        orders.compact();
+        for (uint32_t i = 0; i < INSTRUMENT_COUNT; ++i) {
+            books[i].bids.compact(old, [this, i](order_node_type *node) {
+                (void) orders.insert(node->order.id, order_location_type{node, i, side_what::buy});
+            });
+            books[i].asks.compact(old, [this, i](order_node_type *node) {
+                (void) orders.insert(node->order.id, order_location_type{node, i, side_what::sell});
+            });
+        }
+        traders.compact(old);
+        tokens.compact(old);
+        balances.compact(old);
+        return true;
+    }
+
+    // Write the exchange as a state export, after header filled in with the rest of the lambda.
+    // Every column is read straight out of the containers, so exporting never touches the arena.
+    void export_state(state_export_writer_type &out, state_export_header_type header) const {
+        header.instrument_count = INSTRUMENT_COUNT;
+        header.token_count = tokens.size();
+        header.trader_count = traders.size();
+        header.order_count = orders.size();
+        header.other_balance_count = 0;
+        balances.for_each_other([&header](account_id_type, token_id_type, currency_type amount) {
+            header.other_balance_count += amount != 0;
+        });
+        header.next_id = next_id;
+        out.append(header);
+        for (const auto &instrument : INSTRUMENTS) {
+            out.append(instrument.symbol);
+        }
+        out.end_column();
+        for (token_id_type token = 0; token < tokens.size(); ++token) {
+            out.append(tokens.address(token));
+        }
+        out.end_column();
+        for (account_id_type account = 0; account < traders.size(); ++account) {
+            out.append(traders.address(account));
+        }
+        out.end_column();
+        for (account_id_type account = 0; account < traders.size(); ++account) {
+            out.append(balances.row(account), INSTRUMENT_TOKEN_COUNT);
+        }
+        out.end_column();
+        export_other_balances(out, [](account_id_type account, token_id_type, currency_type) { return account; });
+        export_other_balances(out, [](account_id_type, token_id_type token, currency_type) { return token; });
+        export_other_balances(out, [](account_id_type, token_id_type, currency_type amount) { return amount; });
+        for (const auto &book : books) {
+            out.append(count_offers(book.bids));
+            out.append(count_offers(book.asks));
+        }
+        out.end_column();
+        export_orders(out, [](const resting_order_type &o) { return o.id; });
+        export_orders(out, [](const resting_order_type &o) { return o.trader; });
+        export_orders(out, [](const resting_order_type &o) { return o.price; });
+        export_orders(out, [](const resting_order_type &o) { return o.quantity; });
+    }
+
+    // Rebuild a new exchange from the state export header was read from, once its arena has room for all of it.
+    // Containers are sized up front and every order is queued in priority order, so the arena ends up as packed as
+    // after compaction. Returns false, leaving the exchange partly built, if the export is inconsistent or was made
+    // for other instruments.
+    bool import_state(state_export_reader_type &in, const state_export_header_type &header) {
+        if (header.instrument_count != INSTRUMENT_COUNT || header.token_count < tokens.size()) {
+            (void) fprintf(stderr, "[dapp] state export was made for other instruments\n");
+            return false;
+        }
+        const auto *symbols = in.column<symbol_type>(INSTRUMENT_COUNT);
+        const auto *token_addresses = in.column<token_type>(header.token_count);
+        const auto *trader_addresses = in.column<trader_type>(header.trader_count);
+        const auto *rows = in.column<currency_type>(uint64_t{header.trader_count} * INSTRUMENT_TOKEN_COUNT);
+        exported_balances_type others{.accounts = in.column<account_id_type>(header.other_balance_count),
+            .tokens = in.column<token_id_type>(header.other_balance_count),
+            .amounts = in.column<currency_type>(header.other_balance_count)};
+        const auto *sizes = in.column<uint64_t>(2 * uint64_t{INSTRUMENT_COUNT});
+        exported_orders_type columns{.ids = in.column<id_type>(header.order_count),
+            .traders = in.column<account_id_type>(header.order_count),
+            .prices = in.column<currency_type>(header.order_count),
+            .quantities = in.column<quantity_type>(header.order_count)};
+        if (!symbols || !token_addresses || !trader_addresses || !rows || !others.accounts || !others.tokens ||
+            !others.amounts || !sizes || !columns.ids ||
+            !columns.traders || !columns.prices || !columns.quantities || !in.at_end()) {
+            (void) fprintf(stderr, "[dapp] state export does not match its header\n");
+            return false;
+        }
+        for (uint32_t i = 0; i < INSTRUMENT_COUNT; ++i) {
+            if (symbols[i] != INSTRUMENTS[i].symbol) {
+                (void) fprintf(stderr, "[dapp] state export was made for other instruments\n");
+                return false;
+            }
+        }
+        uint64_t order_count = 0;
+        for (uint32_t i = 0; i < 2 * INSTRUMENT_COUNT && order_count <= header.order_count; ++i) {
+            order_count += std::min(sizes[i], header.order_count + 1 - order_count);
+        }
+        if (order_count != header.order_count) {
+            (void) fprintf(stderr, "[dapp] state export does not match its header\n");
+            return false;
+        }
+        for (uint64_t k = 0; k < header.order_count; ++k) {
+            if (columns.ids[k] == 0 || columns.ids[k] > header.next_id || columns.traders[k] >= header.trader_count ||
+                columns.quantities[k] == 0) {
+                (void) fprintf(stderr, "[dapp] state export holds an invalid order\n");
+                return false;
+            }
+        }
+        // bids and asks alike list their best price first, and no later order of a side may have a better one
+        for (uint64_t i = 0, first = 0; i < 2 * INSTRUMENT_COUNT; first += sizes[i++]) {
+            for (auto k = first + 1; k < first + sizes[i]; ++k) {
+                bool in_order = i % 2 == 0 ? accepts_price<side_what::buy>(columns.prices[k - 1], columns.prices[k])
+                                           : accepts_price<side_what::sell>(columns.prices[k - 1], columns.prices[k]);
+                if (!in_order) {
+                    (void) fprintf(stderr, "[dapp] state export lists orders out of priority order\n");
+                    return false;
+                }
+            }
+        }
+        for (uint64_t k = 0; k < header.other_balance_count; ++k) {
+            if (others.accounts[k] >= header.trader_count || others.tokens[k] < INSTRUMENT_TOKEN_COUNT ||
+                others.tokens[k] >= header.token_count) {
+                (void) fprintf(stderr, "[dapp] state export holds an invalid balance\n");
+                return false;
+            }
+        }
+        // tokens of the instruments were interned by the constructor, and have to come first in the export too
+        if (!tokens.reserve(header.token_count) || !traders.reserve(header.trader_count) ||
+            !balances.reserve(header.trader_count) || !balances.reserve_others(header.other_balance_count) ||
+            !orders.reserve(header.order_count)) {
+            (void) fprintf(stderr, "[dapp] state export does not fit in the arena\n");
+            return false;
+        }
+        for (token_id_type token = 0; token < header.token_count; ++token) {
+            if (tokens.intern(token_addresses[token]) != token) {
+                (void) fprintf(stderr, "[dapp] state export lists tokens out of order\n");
+                return false;
+            }
+        }
+        for (account_id_type account = 0; account < header.trader_count; ++account) {
+            if (traders.intern(trader_addresses[account]) != account) {
+                (void) fprintf(stderr, "[dapp] state export lists a trader twice\n");
+                return false;
+            }
+        }
+        for (account_id_type account = 0; account < header.trader_count; ++account) {
+            for (token_id_type token = 0; token < INSTRUMENT_TOKEN_COUNT; ++token) {
+                balances.at(account, token) = rows[uint64_t{account} * INSTRUMENT_TOKEN_COUNT + token];
+            }
+        }
+        for (uint64_t k = 0; k < header.other_balance_count; ++k) {
+            *balances.find_or_add(others.accounts[k], others.tokens[k]) = others.amounts[k];
+        }
+        uint64_t first = 0;
+        for (uint32_t i = 0; i < INSTRUMENT_COUNT; ++i) {
+            if (!import_offers(books[i].bids, i, side_what::buy, columns, first, first + sizes[2 * i])) {
+                return false;
+            }
+            first += sizes[2 * i];
+            if (!import_offers(books[i].asks, i, side_what::sell, columns, first, first + sizes[2 * i + 1])) {
+                return false;
+            }
+            first += sizes[2 * i + 1];
+        }
+        next_id = header.next_id;
         return true;
     }
 
 private:
-    book_type &find_or_create_book(const symbol_type &symbol) {
-        auto it = books.find(symbol);
-        if (it != books.end()) {
-            return it->second;
+    // Order columns of a state export
+    struct exported_orders_type {
+        const id_type *ids;
+        const account_id_type *traders;
+        const currency_type *prices;
+        const quantity_type *quantities;
+    };
+
+    // Balance columns of a state export, for the tokens not kept in rows
+    struct exported_balances_type {
+        const account_id_type *accounts;
+        const token_id_type *tokens;
+        const currency_type *amounts;
+    };
+
+    template <typename LADDER>
+    static uint64_t count_offers(const LADDER &offers) {
+        uint64_t count = 0;
+        offers.for_each_level(UINT64_MAX, [&count](currency_type, quantity_type, uint64_t n) { count += n; });
+        return count;
+    }
+
+    // write one column of every resting order, book by book, bids before asks, in priority order
+    template <typename F>
+    void export_orders(state_export_writer_type &out, F &&field) const {
+        for (const auto &book : books) {
+            for (const auto &o : book.bids) {
+                out.append(field(o));
+            }
+            for (const auto &o : book.asks) {
+                out.append(field(o));
+            }
+        }
+        out.end_column();
+    }
+
+    // write one column of every nonzero balance in a token not kept in rows
+    template <typename F>
+    void export_other_balances(state_export_writer_type &out, F &&field) const {
+        balances.for_each_other([&](account_id_type account, token_id_type token, currency_type amount) {
+            if (amount != 0) {
+                out.append(field(account, token, amount));
+            }
+        });
+        out.end_column();
+    }
+
+    // Rest orders [first, last) of a state export, listed in priority order, on offers. Levels are created worst
+    // price first, so each one goes at the end of the ladder instead of shifting the ones already there. Returns
+    // false if an order id was taken already or the arena has no room left for the order.
+    template <typename LADDER>
+    bool import_offers(LADDER &offers, uint32_t instrument, side_what side, const exported_orders_type &columns,
+        uint64_t first, uint64_t last) {
+        while (last > first) {
+            auto level = last - 1;
+            while (level > first && columns.prices[level - 1] == columns.prices[last - 1]) {
+                --level;
+            }
+            for (auto k = level; k < last; ++k) {
+                resting_order_type o{columns.ids[k], columns.quantities[k], columns.prices[k], columns.traders[k]};
+                if (orders.find(o.id).node) {
+                    (void) fprintf(stderr, "[dapp] state export lists an order twice\n");
+                    return false;
+                }
+                auto *node = offers.insert(o);
+                if (!node) {
+                    (void) fprintf(stderr, "[dapp] state export does not fit in the arena\n");
+                    return false;
+                }
+                // the index was sized for every order of the export
+                (void) orders.insert(o.id, order_location_type{node, instrument, side});
+            }
+            last = level;
+        }
+        return true;
+    }
+
+    template <size_t... I>
+    static books_type make_books(memory_arena *arena, std::index_sequence<I...>) {
+        return books_type{book_type{INSTRUMENTS[I].symbol, arena}...};
+    }
+
+    template <side_what SIDE>
+    bool place_order(order_type &o, const instrument_type &instrument, order_kind_what kind,
+        time_in_force_what time_in_force, execution_notices_type &reports) {
+        constexpr bool BUY = SIDE == side_what::buy;
+        auto &book = books[instrument.index];
+        auto &offers = offers_of<SIDE>(book);
+        bool market = kind == order_kind_what::market;
+        if (market) {
+            o.price = 0;
+        }
+        // find out how much the book can fill right away before committing to anything
+        currency_type market_cost = 0;
+        if (market || time_in_force == time_in_force_what::fill_or_kill) {
+            auto fillable = fillable_quantity<SIDE>(o, offers, market, market_cost);
+            if (time_in_force == time_in_force_what::fill_or_kill && fillable < o.quantity) {
+                reports.push_back(
+                    {o.trader, event_what::rejection_unfillable, o.id, o.symbol, o.side, o.quantity, o.price});
+                return false;
+            }
+        }
+        // buyers lock quote at their limit price, or exactly what their fills will cost for market buyers, and
+        // sellers lock the base they sell
+        const auto &locked_token = BUY ? instrument.quote : instrument.base;
+        auto size = BUY ? (market ? market_cost : (o.quantity * o.price) / 100) : o.quantity;
+        // a trader never seen before holds no funds, and without room for its account could not be credited fills
+        auto account = address_directory_type::NO_ID;
+        if (get_balance(o.trader, locked_token) >= size) {
+            account = intern_trader(o.trader);
+        }
+        if (account == address_directory_type::NO_ID) {
+            reports.push_back(
+                {o.trader, event_what::rejection_insufficient_funds, o.id, o.symbol, o.side, o.quantity, o.price});
+            return false;
+        }
+        // an order that may rest in the book has to find room there before any funds are locked
+        bool rests = !market && time_in_force == time_in_force_what::good_till_cancel;
+        auto &resting = resting_of<SIDE>(book);
+        if (rests && (!orders.reserve(orders.size() + 1) || !resting.reserve(o.price))) {
+            (void) fprintf(stderr, "[dapp] no room left in the arena for order\n");
+            return false;
+        }
+        auto locked_id = BUY ? instrument.quote_id : instrument.base_id;
+        balances.at(account, locked_id) -= size;
+        // send report acknowledging new order
+        o.id = get_next_id();
+        reports.push_back({o.trader, event_what::new_order, o.id, o.symbol, o.side, o.quantity, o.price});
+        // match against existing orders
+        match<SIDE>(o, account, offers, instrument, market, reports);
+        if (o.is_filled()) {
+            return true;
         }
-        return books.emplace(symbol, book_type{symbol, {}, {}}).first->second;
-        ;
+        // only limit orders good till cancelled rest in the book, the remainder of any other order is cancelled
+        if (rests) {
+            // matching only frees blocks, so the room made above is still there
+            auto *node = resting.insert(resting_order_type{o.id, o.quantity, o.price, account});
+            (void) orders.insert(o.id, order_location_type{node, instrument.index, SIDE});
+        } else {
+            balances.at(account, locked_id) += BUY ? (o.quantity * o.price) / 100 : o.quantity;
+            reports.push_back({o.trader, event_what::cancel_order, o.id, o.symbol, o.side, o.quantity, o.price});
+        }
+        return true;
     }
 
-    wallet_type &find_or_create_wallet(const trader_type &trader) {
-        auto it = wallets.find(trader);
-        if (it != wallets.end()) {
-            return it->second;
+    // id of trader with a row of balances, or NO_ID if the arena has no room left for a new one
+    account_id_type intern_trader(const trader_type &trader) {
+        auto account = traders.find(trader);
+        if (account != address_directory_type::NO_ID || !balances.reserve(traders.size() + 1)) {
+            return account;
         }
-        return wallets.emplace(trader, wallet_type{}).first->second;
-        ;
+        return traders.intern(trader);
     }
 
-    void subtract_from_balance(const trader_type &trader, const token_type &token, currency_type amount) {
-        auto &wallet = find_or_create_wallet(trader);
-        wallet[token] -= amount;
+    // resolve the balance slots of an account for both tokens of an instrument
+    account_type resolve_account(account_id_type account, const instrument_type &instr) {
+        return account_type{traders.address(account), account, balances.slot(account, instr.base_id),
+            balances.slot(account, instr.quote_id), 0, 0};
     }
 
-    void add_to_balance(const trader_type &trader, const token_type &token, currency_type amount) {
-        auto &wallet = find_or_create_wallet(trader);
-        wallet[token] += amount;
+    // walk the offers o would trade against, without touching them, adding up how much of o they can fill and what
+    // those fills cost at the offers' prices
+    template <side_what SIDE>
+    static quantity_type fillable_quantity(const order_type &o, const offers_type<SIDE> &offers, bool market,
+        currency_type &cost) {
+        quantity_type quantity = 0;
+        for (auto it = offers.begin(); it != offers.end() && quantity < o.quantity; ++it) {
+            if (!market && !accepts_price<SIDE>(o.price, it->price)) {
+                break;
+            }
+            auto exec_quantity = std::min(o.quantity - quantity, it->quantity);
+            quantity += exec_quantity;
+            cost += (exec_quantity * it->price) / 100;
+        }
+        return quantity;
     }
 
-    // match order against existing offers, executing trades and notifying both parties
-    template <typename T>
-    void match(order_type &o, T &offers, instrument_type &instr, execution_notices_type &reports) {
-        auto it = offers.begin();
-        while (it != offers.end()) {
-            // ok to drop const becasue the set is ordered by a custom comparator whose key(price) won't be changed
-            auto &best_offer = const_cast<order_type &>(*it);
-            if (o.is_filled() || !o.matches(best_offer)) {
-                return;
+    // match order against existing offers, executing trades and notifying both parties.
+    // SIDE is the side of o, so the price comparison and the direction of every transfer are fixed at compile time.
+    template <side_what SIDE>
+    void match(order_type &o, account_id_type account, offers_type<SIDE> &offers, const instrument_type &instr, bool market,
+        execution_notices_type &reports) {
+        constexpr bool BUY = SIDE == side_what::buy;
+        settlement_type settlement(resolve_account(account, instr));
+        auto accept = [&](currency_type price) { return market || accepts_price<SIDE>(o.price, price); };
+        auto fill = [&](const resting_order_type &offer, quantity_type exec_quantity) {
+            auto *maker = settlement.find_maker(offer.trader);
+            if (!maker) {
+                maker = &settlement.add_maker(balances, resolve_account(offer.trader, instr));
             }
-            auto &buy_order = o.side == side_what::buy ? o : best_offer;
-            auto &sell_order = o.side == side_what::buy ? best_offer : o;
-            auto &buyer = buy_order.trader;
-            auto &seller = sell_order.trader;
-            // execute trade and notify both parties
-            auto exec_quantity = std::min(o.quantity, best_offer.quantity);
-            buy_order.quantity -= exec_quantity;
-            sell_order.quantity -= exec_quantity;
+            auto buy_id = BUY ? o.id : offer.id;
+            auto sell_id = BUY ? offer.id : o.id;
+            auto &buyer = BUY ? settlement.taker() : *maker;
+            auto &seller = BUY ? *maker : settlement.taker();
             // exchange tokens
-            auto exec_price = (o.price + best_offer.price) / 2;
-            add_to_balance(buyer, instr.quote,
-                (exec_quantity * buy_order.price) / 100); // add balance locked at the limit order price
-            subtract_from_balance(buyer, instr.quote,
-                (exec_quantity * exec_price) / 100);                  // subtract balance at the execution price
-            add_to_balance(buyer, instr.base, exec_quantity);         // add bought tokens
-            subtract_from_balance(seller, instr.base, exec_quantity); // subtract sold tokens
-            add_to_balance(seller, instr.quote, (exec_quantity * exec_price) / 100); // add balance at the execution price
+            // market orders take the price of the offer
+            auto exec_price = market ? offer.price : (o.price + offer.price) / 2;
+            // a market buyer locked its fills at the execution price
+            auto locked_price = BUY ? (market ? exec_price : o.price) : offer.price;
+            buyer.base_credit += exec_quantity; // add bought tokens
+            buyer.quote_credit += (exec_quantity * locked_price) / 100 -
+                (exec_quantity * exec_price) / 100; // give back balance locked above the execution price
+            seller.quote_credit += (exec_quantity * exec_price) / 100; // add balance at the execution price
             // notify both parties
-            reports.push_back(
-                {buyer, event_what::execution, buy_order.id, o.symbol, side_what::buy, exec_quantity, exec_price});
-            reports.push_back(
-                {seller, event_what::execution, sell_order.id, o.symbol, side_what::sell, exec_quantity, exec_price});
-            // remove offer from book if filled
-            if (best_offer.is_filled()) {
-                offers.erase(it);
+            reports.push_back({buyer.trader, event_what::execution, buy_id, o.symbol, side_what::buy,
+                exec_quantity, exec_price});
+            reports.push_back({seller.trader, event_what::execution, sell_id, o.symbol, side_what::sell,
+                exec_quantity, exec_price});
+            // the sweep drops filled offers from the book, but they are still in the index
+            if (exec_quantity == offer.quantity) {
+                orders.erase(offer.id);
             }
-            // find next best offer
-            it = offers.begin();
-        }
+        };
+        o.quantity -= offers.sweep(o.quantity, accept, fill);
+        settlement.apply(balances);
     }
 
     currency_type get_balance(const trader_type &trader, const token_type &token) {
-        auto wallet = find_wallet(trader);
-        if (!wallet) {
+        auto account = traders.find(trader);
+        auto id = tokens.find(token);
+        if (account == address_directory_type::NO_ID || id == address_directory_type::NO_ID) {
             return 0;
         }
-        auto it = wallet->find(token);
-        if (it == wallet->end()) {
-            return 0;
-        }
-        return it->second;
+        return balances.get(account, id);
     }
 
     id_type get_next_id() {
@@ -318,6 +772,7 @@ struct rollup_state_type;
 struct lambda_type;
 static bool inspect_state(rollup_state_type *rollup_state, lambda_type *state, const query_type &query,
     uint64_t query_length);
+static bool validate_lambda(const lambda_type *lambda, size_t length, bool report);
 
 ////////////////////////////////////////////////////////////////////////////////
 // Rollup APIs
@@ -337,22 +792,282 @@ static bool inspect_state(rollup_state_type *rollup_state, lambda_type *state, c
 ////////////////////////////////////////////////////////////////////////////////
 // Handlers for advance and inspect state
 
-// Flush dapp state to disk.
-[[maybe_unused]] static bool flush_lambda(rollup_state_type *rollup_state) {
+// Flush the first length bytes of dapp state to disk.
+static bool flush_lambda(rollup_state_type *rollup_state, size_t length) {
+#ifdef BARE_METAL
+    // With an input journal the image file only changes through checkpoints
+    if (rollup_state->journal.is_open()) {
+        return rollup_checkpoint_lambda(rollup_state, length);
+    }
+#endif
     // Flushes state changes made into memory using mmap(2) back to the filesystem.
-    if (msync(rollup_state->lambda, rollup_state->lambda_length, MS_SYNC) < 0) {
+    if (msync(rollup_state->lambda, std::min(length, rollup_state->lambda_length), MS_SYNC) < 0) {
         (void) fprintf(stderr, "[dapp] unable to flush lambda state from memory to disk: %s\n", strerror(errno));
         return false;
     }
     return true;
 }
 
+// "PERNALBD" read as a little-endian integer
+constexpr uint64_t LAMBDA_MAGIC = UINT64_C(0x44424c414e524550);
+
+// Bumped whenever the meaning of the lambda changes in a way its layout hash cannot see
+constexpr uint32_t LAMBDA_FORMAT_VERSION = 1;
+
+// Header at the start of every lambda, telling which build of the dapp it is laid out for
+struct lambda_header_type {
+    uint64_t magic;         // LAMBDA_MAGIC, which tells a lambda from any other image
+    uint32_t version;       // LAMBDA_FORMAT_VERSION of the build that initialized the lambda
+    uint32_t header_length; // bytes of this header
+    uint64_t layout_hash;   // LAMBDA_LAYOUT_HASH of the build that initialized the lambda
+    uint64_t arena_offset;  // where the arena starts in the lambda
+    uint64_t arena_length;  // bytes of the arena, which ends within the image
+};
+
 // Dapp state.
 struct lambda_type {
+    lambda_header_type header;
     perna::exchange ex;
+    uint64_t epoch_index; // epoch of the last advance input
+    uint64_t input_count; // advance inputs taken so far, which tells the inputs in the journal it already took
     memory_arena arena;
 };
 
+// Layout of the lambda, hashed from the sizes and alignments of its members in order, which fix their offsets, of the
+// types stored in its arena, and from the instrument table, which fixes the token ids. Changes that keep all of them,
+// such as two fields of one type swapped, have to bump LAMBDA_FORMAT_VERSION instead.
+constexpr uint64_t LAMBDA_LAYOUT_HASH = [] {
+    uint64_t hash = UINT64_C(0xcbf29ce484222325);
+    auto mix = [&hash](uint64_t value) {
+        for (int i = 0; i < 8; ++i) {
+            hash = (hash ^ ((value >> (8 * i)) & 0xff)) * UINT64_C(0x100000001b3);
+        }
+    };
+    for (auto value : {sizeof(lambda_type), alignof(lambda_type), sizeof(lambda_header_type),
+             alignof(lambda_header_type), sizeof(perna::exchange), alignof(perna::exchange), sizeof(memory_arena),
+             alignof(memory_arena)}) {
+        mix(value);
+    }
+    // types stored in the arena, which the containers of the exchange point into
+    for (auto value : {sizeof(offset_ptr<void>), alignof(offset_ptr<void>), sizeof(perna::resting_order_type),
+             alignof(perna::resting_order_type), sizeof(perna::order_node_type), alignof(perna::order_node_type),
+             sizeof(perna::price_level_type), alignof(perna::price_level_type),
+             sizeof(perna::bids_type::level_entry_type), alignof(perna::bids_type::level_entry_type),
+             sizeof(perna::asks_type::level_entry_type), alignof(perna::asks_type::level_entry_type),
+             sizeof(perna::order_index_type::slot_type), alignof(perna::order_index_type::slot_type),
+             sizeof(perna::address_directory_type::slot_type), alignof(perna::address_directory_type::slot_type),
+             sizeof(eth_address), sizeof(currency_type), sizeof(perna::balance_matrix_type::other_balance_type),
+             alignof(perna::balance_matrix_type::other_balance_type)}) {
+        mix(value);
+    }
+    for (const auto &spec : perna::INSTRUMENT_SPECS) {
+        for (auto c : spec.symbol) {
+            mix(static_cast<uint8_t>(c));
+        }
+        for (auto b : spec.base) {
+            mix(b);
+        }
+        for (auto b : spec.quote) {
+            mix(b);
+        }
+    }
+    return hash;
+}();
+
+// Where the arena starts in the lambda
+static size_t get_arena_offset(const lambda_type *lambda) {
+    return static_cast<size_t>(reinterpret_cast<const char *>(&lambda->arena) - reinterpret_cast<const char *>(lambda));
+}
+
+// Initialize a new lambda over the whole image, writing only its fields and what the exchange allocates.
+// The image is taken to be zero, as a fresh image is, except for what a valid lambda it already holds used, or all of
+// it if it holds anything else, which the new arena zeroes as it goes.
+static lambda_type *initialize_lambda(rollup_state_type *rollup_state) {
+    auto *lambda = reinterpret_cast<lambda_type *>(rollup_state->lambda);
+    auto arena_length = rollup_state->lambda_length - get_arena_offset(lambda);
+    uint64_t stale_length =
+        validate_lambda(lambda, rollup_state->lambda_length, false) ? lambda->arena.get_extent() : arena_length;
+    new (&lambda->arena) memory_arena(arena_length, stale_length);
+    new (&lambda->ex) perna::exchange(&lambda->arena);
+    lambda->epoch_index = 0;
+    lambda->input_count = 0;
+    lambda->header = lambda_header_type{.magic = LAMBDA_MAGIC,
+        .version = LAMBDA_FORMAT_VERSION,
+        .header_length = sizeof(lambda_header_type),
+        .layout_hash = LAMBDA_LAYOUT_HASH,
+        .arena_offset = get_arena_offset(lambda),
+        .arena_length = lambda->arena.get_length()};
+    return lambda;
+}
+
+// Check, without walking anything, that an image of length bytes holds a lambda laid out as this build lays it out,
+// with its arena within the image, so a lambda initialized by another build is refused rather than misread.
+// Reports why the image was refused if report.
+static bool validate_lambda(const lambda_type *lambda, size_t length, bool report) {
+    if (length < sizeof(lambda_type) || lambda->header.magic != LAMBDA_MAGIC) {
+        if (report) {
+            (void) fprintf(stderr, "[dapp] image holds no lambda\n");
+        }
+        return false;
+    }
+    const auto &header = lambda->header;
+    if (header.version != LAMBDA_FORMAT_VERSION || header.header_length != sizeof(lambda_header_type)) {
+        if (report) {
+            (void) fprintf(stderr, "[dapp] lambda has format version %" PRIu32 ", expected %" PRIu32 "\n",
+                header.version, LAMBDA_FORMAT_VERSION);
+        }
+        return false;
+    }
+    if (header.layout_hash != LAMBDA_LAYOUT_HASH) {
+        if (report) {
+            (void) fprintf(stderr, "[dapp] lambda has layout %016" PRIx64 ", expected %016" PRIx64 "\n",
+                header.layout_hash, LAMBDA_LAYOUT_HASH);
+        }
+        return false;
+    }
+    if (header.arena_offset != get_arena_offset(lambda) || header.arena_length != lambda->arena.get_length() ||
+        header.arena_length > length - header.arena_offset ||
+        lambda->arena.get_used_length() > lambda->arena.get_data_length()) {
+        if (report) {
+            (void) fprintf(stderr, "[dapp] lambda arena does not fit in the image\n");
+        }
+        return false;
+    }
+    return true;
+}
+
+// Lambda of the rollup: a new one if initialize, otherwise the one in the image once validated, or nullptr
+static lambda_type *open_lambda(rollup_state_type *rollup_state, bool initialize) {
+    if (initialize) {
+        return initialize_lambda(rollup_state);
+    }
+    auto *lambda = reinterpret_cast<lambda_type *>(rollup_state->lambda);
+    return validate_lambda(lambda, rollup_state->lambda_length, true) ? lambda : nullptr;
+}
+
+// Bytes of the lambda ahead of the arena data
+static size_t get_header_length(lambda_type *state) {
+    return static_cast<size_t>(static_cast<char *>(state->arena.get_data()) - reinterpret_cast<char *>(state));
+}
+
+// Flush the part of the lambda that may have changed since it was last flushed: everything ahead of the arena data,
+// and the arena up to the furthest its used area reached, past which nothing is ever written. The range is only a
+// bound, as the kernel finds the pages written since the last flush through the page cache and writes back those
+// alone, so a flush costs about the same for any range and its I/O is proportional to the pages the inputs touched.
+static bool flush_dirty_lambda(rollup_state_type *rollup_state, lambda_type *state) {
+    if (!flush_lambda(rollup_state, get_header_length(state) + state->arena.get_dirty_length())) {
+        return false;
+    }
+    state->arena.mark_flushed();
+    return true;
+}
+
+#ifndef EMULATOR
+// Flush the inputs processed since the lambda was last flushed, if any
+static void flush_unflushed_inputs(rollup_state_type *rollup_state, lambda_type *state) {
+#ifdef BARE_METAL
+    // a checkpoint empties the journal, and inputs being replayed are not appended to it again, so a replay is only
+    // checkpointed once it is over
+    if (rollup_state->replaying) {
+        return;
+    }
+#endif
+    if (rollup_state->unflushed_input_count != 0 && flush_dirty_lambda(rollup_state, state)) {
+        rollup_state->unflushed_input_count = 0;
+        rollup_state->flushed_at = lambda_clock();
+    }
+}
+
+// Commit the input just processed to the image file when the durability policy of the backend asks for it
+static void commit_input(rollup_state_type *rollup_state, lambda_type *state) {
+    const auto &policy = rollup_state->config.lambda_durability;
+    ++rollup_state->unflushed_input_count;
+    if (policy.what == lambda_durability_what::input ||
+        (policy.what == lambda_durability_what::inputs && rollup_state->unflushed_input_count >= policy.count) ||
+        (policy.what == lambda_durability_what::seconds && lambda_clock() - rollup_state->flushed_at >= policy.count)) {
+        flush_unflushed_inputs(rollup_state, state);
+    }
+}
+
+// Under a per-epoch policy, commit the inputs of the previous epoch before the first input of the next one
+static void commit_epoch(rollup_state_type *rollup_state, lambda_type *state, uint64_t epoch_index) {
+    if (rollup_state->config.lambda_durability.what == lambda_durability_what::epoch &&
+        epoch_index != state->epoch_index) {
+        flush_unflushed_inputs(rollup_state, state);
+    }
+}
+#else
+// Commit every input to the lambda drive as soon as it is processed
+static void commit_input(rollup_state_type *rollup_state, lambda_type *state) {
+    (void) flush_dirty_lambda(rollup_state, state);
+}
+#endif
+
+#ifdef BARE_METAL
+// Publish a snapshot of the lambda for inspect servers, which read it while the lambda keeps advancing
+static void publish_lambda(rollup_state_type *rollup_state, lambda_type *state) {
+    if (rollup_state->config.snapshot_filename &&
+        rollup_publish_lambda(rollup_state, get_header_length(state) + state->arena.get_used_length())) {
+        rollup_state->unpublished_input_count = 0;
+        rollup_state->published_at = lambda_clock();
+    }
+}
+
+// Publish the input just processed once a whole snapshot interval of inputs is waiting, or once the last snapshot is
+// old enough, so inspects do not lag far behind while inputs trickle in
+static void publish_input(rollup_state_type *rollup_state, lambda_type *state) {
+    const auto &config = rollup_state->config;
+    if (++rollup_state->unpublished_input_count >= config.snapshot_interval ||
+        lambda_clock() - rollup_state->published_at >= config.snapshot_seconds) {
+        publish_lambda(rollup_state, state);
+    }
+}
+#endif
+
+// Compact at an epoch boundary once free blocks take more than a quarter of the used area
+constexpr uint64_t AUTO_COMPACTION_FREE_LIST_FRACTION = 4;
+
+static arena_fragmentation_type to_arena_fragmentation(const memory_arena &arena) {
+    return arena_fragmentation_type{.used = arena.get_used_length(),
+        .live = arena.get_live_length(),
+        .free_list = arena.get_free_list_length(),
+        .free_block_count = arena.get_free_block_count()};
+}
+
+// Compact the arena, issuing a notice with how fragmented it was before and after.
+// Returns false, leaving the arena as it was, if there is no memory to copy it into.
+static bool compact_arena(rollup_state_type *rollup_state, lambda_type *state) {
+    // the copy of the arena taken for compaction is the one thing advancing state may allocate
+    [[maybe_unused]] allocation_audit_exemption_type exemption;
+    arena_compaction_notice_type notice{.what = notice_what::arena_compaction,
+        .before = to_arena_fragmentation(state->arena),
+        .after = {}};
+    if (!state->ex.compact(&state->arena)) {
+        (void) fprintf(stderr, "[dapp] no memory to copy the arena for compaction\n");
+        return false;
+    }
+    notice.after = to_arena_fragmentation(state->arena);
+    // std::cerr << "[dapp] " << notice << '\n';
+    if (!rollup_write_notice(rollup_state, notice)) {
+        (void) fprintf(stderr, "[dapp] unable to issue arena compaction notice\n");
+    }
+    return true;
+}
+
+// Compact the arena with the first input of every epoch, if it became fragmented enough. Without the memory to do so
+// the arena is left as it is, and the input goes on.
+static void compact_arena_at_epoch_boundary(rollup_state_type *rollup_state, lambda_type *state,
+    uint64_t epoch_index) {
+    if (epoch_index == state->epoch_index) {
+        return;
+    }
+    state->epoch_index = epoch_index;
+    const auto &arena = state->arena;
+    if (arena.get_free_list_length() * AUTO_COMPACTION_FREE_LIST_FRACTION > arena.get_used_length()) {
+        (void) compact_arena(rollup_state, state);
+    }
+}
+
 static bool advance_state_deposit(rollup_state_type *rollup_state, lambda_type *state,
     const erc20_deposit_input_type &deposit) {
     // std::cerr << "[dapp] " << deposit << '\n';
@@ -362,52 +1077,92 @@ static bool advance_state_deposit(rollup_state_type *rollup_state, lambda_type *
         return false;
     }
     auto quantity = to_uint64_t(deposit.amount);
-    state->ex.deposit(deposit.sender, deposit.token, quantity);
+    if (!state->ex.deposit(deposit.sender, deposit.token, quantity)) {
+        (void) fprintf(stderr, "[dapp] no room left in the arena for deposit\n");
+        return false;
+    }
     notice_type notice{.what = notice_what::wallet_deposit,
         .wallet = wallet_notice_type{.trader = deposit.sender, .token = deposit.token, .quantity = quantity}};
     // std::cerr << "[dapp] " << notice.wallet << '\n';
     if (!rollup_write_notice(rollup_state, notice)) {
         (void) fprintf(stderr, "[dapp] unable to issue execution notice\n");
     }
-    // Commit changes to rollup state
-    (void) flush_lambda(rollup_state);
     return true;
 }
 
-static bool advance_state_new_order(rollup_state_type *rollup_state, lambda_type *state, const eth_address &sender,
-    const new_order_input_type &new_order) {
-    // std::cerr << "[dapp] " << new_order << '\n';
-    execution_notices_type notices;
-    state->ex.new_order(perna::order_type{.id = 0,
-                            .trader = sender,
-                            .symbol = new_order.symbol,
-                            .side = new_order.side,
-                            .price = new_order.price,
-                            .quantity = new_order.quantity},
-        notices);
-    // Loop over execution notices emitting
-    for (const auto &execution : notices) {
+static perna::order_type to_order(const eth_address &sender, const new_order_input_type &new_order) {
+    return perna::order_type{.id = 0,
+        .trader = sender,
+        .symbol = new_order.symbol,
+        .side = new_order.side,
+        .price = new_order.price,
+        .quantity = new_order.quantity};
+}
+
+// Kind of a new order, taking a zeroed one as a limit order
+static order_kind_what get_order_kind(const new_order_input_type &new_order) {
+    return new_order.kind == order_kind_what{} ? order_kind_what::limit : new_order.kind;
+}
+
+// Time in force of a new order, taking a zeroed one as good till cancel
+static time_in_force_what get_time_in_force(const new_order_input_type &new_order) {
+    return new_order.time_in_force == time_in_force_what{} ? time_in_force_what::good_till_cancel
+                                                           : new_order.time_in_force;
+}
+
+static bool is_valid_new_order(const new_order_input_type &new_order) {
+    switch (get_order_kind(new_order)) {
+        case order_kind_what::limit:
+        case order_kind_what::market:
+            break;
+        default:
+            return false;
+    }
+    switch (get_time_in_force(new_order)) {
+        case time_in_force_what::good_till_cancel:
+        case time_in_force_what::immediate_or_cancel:
+        case time_in_force_what::fill_or_kill:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Place a validated new order
+static void place_new_order(lambda_type *state, const eth_address &sender, const new_order_input_type &new_order,
+    execution_notices_type &notices) {
+    state->ex.new_order(to_order(sender, new_order), get_order_kind(new_order), get_time_in_force(new_order), notices);
+}
+
+// Emit one notice per execution notice
+static void write_execution_notices(rollup_state_type *rollup_state, const execution_notice_type *notices,
+    size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        const auto &execution = notices[i];
         // std::cerr << "[dapp] " << execution << '\n';
         if (!rollup_write_notice(rollup_state, notice_type{.what = notice_what::execution, .execution = execution})) {
             (void) fprintf(stderr, "[dapp] unable to issue execution notice\n");
         }
     }
-    // Commit changes to rollup state
-    (void) flush_lambda(rollup_state);
-    return true;
 }
 
-static bool advance_state_cancel_order(rollup_state_type *rollup_state, lambda_type *state, const eth_address &sender,
-    const cancel_order_input_type &cancel_order) {
-    // std::cerr << "[dapp] " << cancel_order << '\n';
-    // Commit changes to rollup state
-    (void) flush_lambda(rollup_state);
-    return true;
+// Emit execution notices packed into as few execution batch notices as possible
+static void write_execution_batch_notices(rollup_state_type *rollup_state, const execution_notice_type *notices,
+    size_t count) {
+    execution_batch_notice_type batch{.what = notice_what::execution_batch, .entry_count = 0, .entries = {}};
+    for (size_t i = 0; i < count; i += batch.entry_count) {
+        batch.entry_count = std::min<uint64_t>(count - i, MAX_EXECUTION_BATCH_ENTRY);
+        std::copy_n(notices + i, batch.entry_count, batch.entries.begin());
+        if (!rollup_write_notice(rollup_state, batch,
+                offsetof(execution_batch_notice_type, entries) + batch.entry_count * sizeof(execution_notice_type))) {
+            (void) fprintf(stderr, "[dapp] unable to issue execution batch notice\n");
+        }
+    }
 }
 
-static bool advance_state_withdraw(rollup_state_type *rollup_state, lambda_type *state, const eth_address &sender,
+// Withdraw tokens, issuing the voucher that transfers them back to the trader and a notice marking the event
+static bool withdraw_and_notify(rollup_state_type *rollup_state, lambda_type *state, const eth_address &sender,
     const withdraw_input_type &withdraw) {
-    // std::cerr << "[dapp] " << withdraw << '\n';
     if (state->ex.withdraw(sender, withdraw.token, withdraw.quantity)) {
         be256 amount = to_be256(withdraw.quantity);
         erc20_transfer_payload payload = encode_erc20_transfer(sender, amount);
@@ -424,12 +1179,122 @@ static bool advance_state_withdraw(rollup_state_type *rollup_state, lambda_type
             (void) fprintf(stderr, "[dapp] unable to issue execution notice\n");
         }
     }
-    // Commit changes to rollup state
-    (void) flush_lambda(rollup_state);
     return true;
 }
 
-static bool advance_state(rollup_state_type *rollup_state, lambda_type *state,
+static bool advance_state_new_order(rollup_state_type *rollup_state, lambda_type *state, const eth_address &sender,
+    const new_order_input_type &new_order) {
+    // std::cerr << "[dapp] " << new_order << '\n';
+    if (!is_valid_new_order(new_order)) {
+        (void) fprintf(stderr, "[dapp] invalid new order options\n");
+        return false;
+    }
+    auto &notices = open_execution_notices(rollup_state, write_execution_notices);
+    place_new_order(state, sender, new_order, notices);
+    notices.flush();
+    return true;
+}
+
+static bool advance_state_cancel_order(rollup_state_type *rollup_state, lambda_type *state, const eth_address &sender,
+    const cancel_order_input_type &cancel_order) {
+    // std::cerr << "[dapp] " << cancel_order << '\n';
+    auto &notices = open_execution_notices(rollup_state, write_execution_notices);
+    state->ex.cancel_order(sender, cancel_order.id, notices);
+    notices.flush();
+    return true;
+}
+
+static bool advance_state_withdraw(rollup_state_type *rollup_state, lambda_type *state, const eth_address &sender,
+    const withdraw_input_type &withdraw) {
+    // std::cerr << "[dapp] " << withdraw << '\n';
+    return withdraw_and_notify(rollup_state, state, sender, withdraw);
+}
+
+static bool advance_state_batch(rollup_state_type *rollup_state, lambda_type *state, const eth_address &sender,
+    const batch_input_type &batch, uint64_t batch_length) {
+    // std::cerr << "[dapp] " << batch << '\n';
+    // Validate the whole batch before applying any of it
+    if (batch_length < offsetof(batch_input_type, entries) || batch.entry_count > MAX_BATCH_ENTRY ||
+        batch_length < offsetof(batch_input_type, entries) + batch.entry_count * sizeof(batch_entry_type)) {
+        (void) fprintf(stderr, "[dapp] invalid batch length\n");
+        return false;
+    }
+    for (uint64_t i = 0; i < batch.entry_count; ++i) {
+        const auto &entry = batch.entries[i];
+        if ((entry.what != user_input_what::new_order || !is_valid_new_order(entry.new_order)) &&
+            entry.what != user_input_what::cancel_order && entry.what != user_input_what::withdraw) {
+            (void) fprintf(stderr, "[dapp] invalid batch entry %" PRIu64 "\n", i);
+            return false;
+        }
+    }
+    // Execution notices of all entries share the same batch notices
+    auto &notices = open_execution_notices(rollup_state, write_execution_batch_notices);
+    for (uint64_t i = 0; i < batch.entry_count; ++i) {
+        const auto &entry = batch.entries[i];
+        switch (entry.what) {
+            case user_input_what::new_order:
+                place_new_order(state, sender, entry.new_order, notices);
+                break;
+            case user_input_what::cancel_order:
+                state->ex.cancel_order(sender, entry.cancel_order.id, notices);
+                break;
+            case user_input_what::withdraw:
+                // Keep notices in the same order as the entries that caused them
+                notices.flush();
+                (void) withdraw_and_notify(rollup_state, state, sender, entry.withdraw);
+                break;
+            default:
+                break;
+        }
+    }
+    notices.flush();
+    return true;
+}
+
+#ifndef EMULATOR
+// Keep the arena at most a quarter full, so any single input fits even if it doubles the largest container.
+// Growing the image file is cheap, as the pages beyond what the arena used are never touched.
+constexpr uint64_t LAMBDA_GROWTH_HEADROOM = 4;
+
+// Grow the lambda of a host backend until its arena keeps used bytes within the headroom, returning where the lambda
+// is mapped afterwards
+static lambda_type *reserve_lambda(rollup_state_type *rollup_state, lambda_type *state, uint64_t used) {
+    if (used * LAMBDA_GROWTH_HEADROOM <= state->arena.get_data_length()) {
+        return state;
+    }
+    // bytes of the lambda ahead of the arena data, which stay the same as it grows
+    auto overhead = rollup_state->lambda_length - state->arena.get_data_length();
+    auto length = rollup_state->lambda_length;
+    while (used * LAMBDA_GROWTH_HEADROOM > length - overhead) {
+        length *= 2;
+    }
+    auto arena_offset = get_arena_offset(state);
+    if (!rollup_grow_lambda(rollup_state, length)) {
+        return state;
+    }
+    state = reinterpret_cast<lambda_type *>(rollup_state->lambda);
+    state->arena.grow(length - arena_offset);
+    state->header.arena_length = state->arena.get_length();
+    return state;
+}
+
+// Grow the lambda of a host backend before an input could run the arena out of space, returning where the lambda
+// is mapped afterwards
+static lambda_type *grow_lambda(rollup_state_type *rollup_state, lambda_type *state) {
+    return reserve_lambda(rollup_state, state, state->arena.get_used_length());
+}
+#endif
+
+static bool advance_state_compact_arena(rollup_state_type *rollup_state, lambda_type *state,
+    const eth_address &sender) {
+    if (sender != ADMIN_ADDRESS) {
+        (void) fprintf(stderr, "[dapp] arena compaction is restricted to the admin\n");
+        return false;
+    }
+    return compact_arena(rollup_state, state);
+}
+
+static bool advance_state_input(rollup_state_type *rollup_state, lambda_type *state,
     const input_metadata_type &input_metadata, const input_type &input, uint64_t input_length) {
     // If sender was ERC20_PORTAL_ADDRESS, this must be a deposit
     if (input_metadata.sender == ERC20_PORTAL_ADDRESS && input_length == sizeof(erc20_deposit_input_type)) {
@@ -443,12 +1308,37 @@ static bool advance_state(rollup_state_type *rollup_state, lambda_type *state,
             return advance_state_cancel_order(rollup_state, state, input_metadata.sender, input.user.cancel_order);
         case user_input_what::withdraw:
             return advance_state_withdraw(rollup_state, state, input_metadata.sender, input.user.withdraw);
+        case user_input_what::batch:
+            return advance_state_batch(rollup_state, state, input_metadata.sender, input.user.batch,
+                input_length - std::min<uint64_t>(input_length, offsetof(user_input_type, batch)));
+        case user_input_what::compact_arena:
+            return advance_state_compact_arena(rollup_state, state, input_metadata.sender);
     }
     // Otherwise it is an invalid request
     (void) fprintf(stderr, "[dapp] invalid advance state request\n");
     return false;
 }
 
+static bool advance_state(rollup_state_type *rollup_state, lambda_type *state,
+    const input_metadata_type &input_metadata, const input_type &input, uint64_t input_length) {
+    [[maybe_unused]] allocation_audit_type audit;
+#ifndef EMULATOR
+    commit_epoch(rollup_state, state, input_metadata.epoch_index);
+#endif
+    compact_arena_at_epoch_boundary(rollup_state, state, input_metadata.epoch_index);
+#ifndef EMULATOR
+    state = grow_lambda(rollup_state, state);
+#endif
+    auto accept = advance_state_input(rollup_state, state, input_metadata, input, input_length);
+    ++state->input_count;
+    // Commit changes to rollup state
+    commit_input(rollup_state, state);
+#ifdef BARE_METAL
+    publish_input(rollup_state, state);
+#endif
+    return accept;
+}
+
 static bool inspect_state_book(rollup_state_type *rollup_state, lambda_type *state, const book_query_type &query) {
     // std::cerr << "[dapp] " << query << '\n';
     report_type report{.what = report_what::book, .book = { .symbol = query.symbol, .entry_count = 0 } };
@@ -460,7 +1350,7 @@ static bool inspect_state_book(rollup_state_type *rollup_state, lambda_type *sta
         while ((b != book->bids.end() || a != book->asks.end())) {
             if (b != book->bids.end()) {
                 report.book.entries[report.book.entry_count] = book_entry_type{
-                    .trader = b->trader,
+                    .trader = state->ex.trader_address(b->trader),
                     .id = b->id,
                     .side = side_what::buy,
                     .quantity = b->quantity,
@@ -473,7 +1363,7 @@ static bool inspect_state_book(rollup_state_type *rollup_state, lambda_type *sta
             }
             if (a != book->asks.end()) {
                 report.book.entries[report.book.entry_count] = book_entry_type{
-                    .trader = a->trader,
+                    .trader = state->ex.trader_address(a->trader),
                     .id = a->id,
                     .side = side_what::sell,
                     .quantity = a->quantity,
@@ -493,18 +1383,41 @@ static bool inspect_state_book(rollup_state_type *rollup_state, lambda_type *sta
     return true;
 }
 
+static bool inspect_state_book_levels(rollup_state_type *rollup_state, lambda_type *state,
+    const book_levels_query_type &query) {
+    // std::cerr << "[dapp] " << query << '\n';
+    report_type report{.what = report_what::book_levels,
+        .book_levels = {.symbol = query.symbol, .bid_count = 0, .ask_count = 0, .bids = {}, .asks = {}}};
+    auto depth = std::min(query.depth, MAX_BOOK_LEVEL);
+    auto *book = state->ex.find_book(query.symbol);
+    if (book) {
+        // levels keep their totals up to date, so this never touches a resting order
+        auto &levels = report.book_levels;
+        book->bids.for_each_level(depth, [&](currency_type price, quantity_type quantity, uint64_t count) {
+            levels.bids[levels.bid_count++] = book_level_entry_type{price, quantity, count};
+        });
+        book->asks.for_each_level(depth, [&](currency_type price, quantity_type quantity, uint64_t count) {
+            levels.asks[levels.ask_count++] = book_level_entry_type{price, quantity, count};
+        });
+    }
+    if (!rollup_write_report(rollup_state, report)) {
+        (void) fprintf(stderr, "[dapp] unable to issue book levels query report\n");
+    }
+    // std::cerr << "[dapp] " << report.book_levels << '\n';
+    return true;
+}
+
 static bool inspect_state_wallet(rollup_state_type *rollup_state, lambda_type *state, const wallet_query_type &query) {
     // std::cerr << "[dapp] " << query << '\n';
     report_type report{.what = report_what::wallet, .wallet = { .entry_count = 0 } };
-    auto *wallet = state->ex.find_wallet(query.trader);
-    if (wallet) {
-        for (auto& [token, amount]: *wallet) {
-            if (report.wallet.entry_count >= MAX_WALLET_ENTRY) {
-                break;
-            }
+    state->ex.for_each_balance(query.trader, [&](const token_type &token, currency_type amount) {
+        if (report.wallet.entry_count < MAX_WALLET_ENTRY) {
             report.wallet.entries[report.wallet.entry_count++] = wallet_entry_type{token, amount};
         }
-    }
+    });
+    // list tokens by address, independently of the order they were first seen in
+    std::sort(report.wallet.entries.begin(), report.wallet.entries.begin() + report.wallet.entry_count,
+        [](const wallet_entry_type &a, const wallet_entry_type &b) { return a.token < b.token; });
     if (!rollup_write_report(rollup_state, report)) {
         (void) fprintf(stderr, "[dapp] unable to issue book query report\n");
     }
@@ -512,6 +1425,29 @@ static bool inspect_state_wallet(rollup_state_type *rollup_state, lambda_type *s
     return true;
 }
 
+static arena_usage_entry_type to_arena_usage_entry(const arena_usage_type &usage) {
+    return arena_usage_entry_type{usage.bytes, usage.block_count};
+}
+
+static bool inspect_state_arena(rollup_state_type *rollup_state, lambda_type *state) {
+    const auto &arena = state->arena;
+    report_type report{.what = report_what::arena,
+        .arena = {.capacity = arena.get_data_length(),
+            .used = arena.get_used_length(),
+            .live = arena.get_live_length(),
+            .high_watermark = arena.get_peak_live_length(),
+            .free_list = arena.get_free_list_length(),
+            .order_nodes = to_arena_usage_entry(arena.get_usage(arena_usage_what::order)),
+            .book_nodes = to_arena_usage_entry(arena.get_usage(arena_usage_what::book)),
+            .wallet_nodes = to_arena_usage_entry(arena.get_usage(arena_usage_what::wallet)),
+            .other = to_arena_usage_entry(arena.get_usage(arena_usage_what::other))}};
+    if (!rollup_write_report(rollup_state, report)) {
+        (void) fprintf(stderr, "[dapp] unable to issue arena query report\n");
+    }
+    // std::cerr << "[dapp] " << report.arena << '\n';
+    return true;
+}
+
 static bool inspect_state(rollup_state_type *rollup_state, lambda_type *state, const query_type &query,
     uint64_t query_length) {
     switch (query.what) {
@@ -519,6 +1455,10 @@ static bool inspect_state(rollup_state_type *rollup_state, lambda_type *state, c
             return inspect_state_book(rollup_state, state, query.book);
         case query_what::wallet:
             return inspect_state_wallet(rollup_state, state, query.wallet);
+        case query_what::book_levels:
+            return inspect_state_book_levels(rollup_state, state, query.book_levels);
+        case query_what::arena:
+            return inspect_state_arena(rollup_state, state);
     }
     (void) fprintf(stderr, "[dapp] invalid inspect state request\n");
     return false;
@@ -526,7 +1466,6 @@ static bool inspect_state(rollup_state_type *rollup_state, lambda_type *state, c
 
 #ifdef EMULATOR
 int main(int argc, char *argv[]) {
-    uint64_t lambda_virtual_start = LAMBDA_VIRTUAL_START;
     const char *lambda_drive_label = "lambda";
     bool initialize_lambda = false;
     int end = 0;
@@ -534,12 +1473,6 @@ int main(int argc, char *argv[]) {
         end = 0;
         if (sscanf(argv[i], "--lambda-drive-label=%n", &end) == 0 && end != 0) {
             lambda_drive_label = argv[i] + end;
-        } else if (sscanf(argv[i], "--lambda-virtual-start=0x%" SCNx64 "%n", &lambda_virtual_start, &end) == 1 &&
-            argv[i][end] == 0) {
-            ;
-        } else if (sscanf(argv[i], "--lambda-virtual-start=%" SCNu64 "%n", &lambda_virtual_start, &end) == 1 &&
-            argv[i][end] == 0) {
-            ;
         } else if (strcmp(argv[i], "--initialize-lambda") == 0) {
             initialize_lambda = true;
         } else {
@@ -547,18 +1480,14 @@ int main(int argc, char *argv[]) {
             return 1;
         }
     }
-    auto *rollup_state = rollup_open(lambda_virtual_start, lambda_drive_label);
+    auto *rollup_state = rollup_open(lambda_drive_label);
     if (!rollup_state) {
         (void) fprintf(stderr, "[dapp] unable to initialize rollup\n");
         return 1;
     }
-    lambda_type *lambda = reinterpret_cast<lambda_type *>(rollup_state->lambda);
-    g_arena = &lambda->arena;
-    if (initialize_lambda) {
-        memset(lambda, 0, rollup_state->lambda_length);
-        new (&lambda->arena) memory_arena(rollup_state->lambda_length -
-            (reinterpret_cast<char *>(&lambda->arena) - reinterpret_cast<char *>(lambda)));
-        new (&lambda->ex) perna::exchange();
+    if (!open_lambda(rollup_state, initialize_lambda)) {
+        (void) fprintf(stderr, "[dapp] unable to open lambda\n");
+        return 1;
     }
     rollup_request_loop<lambda_type, input_type, query_type>(rollup_state, advance_state, inspect_state);
     // Unreachable code.
@@ -566,27 +1495,102 @@ int main(int argc, char *argv[]) {
 #endif
 
 #ifdef BARE_METAL
+// Arena bytes an import takes at most for every byte of the export. A resting order takes 28 bytes of the export, and
+// its node, index slots and, at worst, a level of its own take less than 8 times that in the arena.
+constexpr uint64_t STATE_IMPORT_EXPANSION = 8;
+
+// Export the state of the lambda to filename
+static bool export_lambda_state(lambda_type *state, const char *filename) {
+    state_export_writer_type out;
+    if (!out.open(filename)) {
+        return false;
+    }
+    state->ex.export_state(out,
+        state_export_header_type{.magic = STATE_EXPORT_MAGIC,
+            .version = STATE_EXPORT_VERSION,
+            .instrument_count = 0,
+            .token_count = 0,
+            .trader_count = 0,
+            .order_count = 0,
+            .other_balance_count = 0,
+            .next_id = 0,
+            .epoch_index = state->epoch_index,
+            .input_count = state->input_count});
+    return out.close();
+}
+
+// Initialize a new lambda from the state export at filename, growing it first to fit everything the export holds.
+// Returns where the lambda is mapped afterwards, or nullptr.
+static lambda_type *import_lambda_state(rollup_state_type *rollup_state, const char *filename) {
+    state_export_reader_type in;
+    if (!in.open(filename)) {
+        return nullptr;
+    }
+    const auto *header = in.column<state_export_header_type>(1);
+    if (!header || header->magic != STATE_EXPORT_MAGIC || header->version != STATE_EXPORT_VERSION) {
+        (void) fprintf(stderr, "[dapp] '%s' is not a state export of version %" PRIu32 "\n", filename,
+            STATE_EXPORT_VERSION);
+        return nullptr;
+    }
+    auto *state = initialize_lambda(rollup_state);
+    state = reserve_lambda(rollup_state, state, STATE_IMPORT_EXPANSION * in.get_length());
+    if (!state->ex.import_state(in, *header)) {
+        // a lambda imported in part must never be taken for a whole one
+        state->header.magic = 0;
+        return nullptr;
+    }
+    state->epoch_index = header->epoch_index;
+    state->input_count = header->input_count;
+    return state;
+}
+
 int main(int argc, char *argv[]) {
     rollup_config_type config;
-    config.lambda_virtual_start = LAMBDA_VIRTUAL_START;
     bool initialize_lambda = false;
+    const char *import_filename = nullptr;
+    const char *export_filename = nullptr;
     int end = 0;
     for (int i = 1; i < argc; ++i) {
         end = 0;
         if (sscanf(argv[i], "--image-filename=%n", &end) == 0 && end != 0) {
             config.image_filename = argv[i] + end;
+        } else if (sscanf(argv[i], "--import-state=%n", &end) == 0 && end != 0) {
+            import_filename = argv[i] + end;
+        } else if (sscanf(argv[i], "--export-state=%n", &end) == 0 && end != 0) {
+            export_filename = argv[i] + end;
+        } else if (strcmp(argv[i], "--lambda-huge-pages") == 0) {
+            config.lambda_mapping.huge_pages = true;
+        } else if (strcmp(argv[i], "--lambda-prefault") == 0) {
+            config.lambda_mapping.prefault = true;
+        } else if (strcmp(argv[i], "--lambda-flush=input") == 0) {
+            config.lambda_durability = {.what = lambda_durability_what::input, .count = 1};
+        } else if (sscanf(argv[i], "--lambda-flush=inputs:%" SCNu64 "%n", &config.lambda_durability.count, &end) == 1 &&
+            argv[i][end] == 0 && config.lambda_durability.count != 0) {
+            config.lambda_durability.what = lambda_durability_what::inputs;
+        } else if (strcmp(argv[i], "--lambda-flush=epoch") == 0) {
+            config.lambda_durability = {.what = lambda_durability_what::epoch, .count = 1};
+        } else if (sscanf(argv[i], "--lambda-flush=seconds:%" SCNu64 "%n", &config.lambda_durability.count, &end) == 1 &&
+            argv[i][end] == 0 && config.lambda_durability.count != 0) {
+            config.lambda_durability.what = lambda_durability_what::seconds;
+        } else if (sscanf(argv[i], "--journal-filename=%n", &end) == 0 && end != 0) {
+            config.journal_filename = argv[i] + end;
+        } else if (sscanf(argv[i], "--journal-sync=%" SCNu64 "%n", &config.journal_group, &end) == 1 &&
+            argv[i][end] == 0 && config.journal_group != 0) {
+            ;
+        } else if (sscanf(argv[i], "--snapshot-filename=%n", &end) == 0 && end != 0) {
+            config.snapshot_filename = argv[i] + end;
+        } else if (sscanf(argv[i], "--snapshot-interval=%" SCNu64 "%n", &config.snapshot_interval, &end) == 1 &&
+            argv[i][end] == 0 && config.snapshot_interval != 0) {
+            ;
+        } else if (sscanf(argv[i], "--snapshot-seconds=%" SCNu64 "%n", &config.snapshot_seconds, &end) == 1 &&
+            argv[i][end] == 0) {
+            ;
         } else if (sscanf(argv[i], "--rollup-input-format=%n", &end) == 0 && end != 0) {
             config.input_format = argv[i] + end;
         } else if (sscanf(argv[i], "--rollup-input-metadata-format=%n", &end) == 0 && end != 0) {
             config.input_metadata_format = argv[i] + end;
         } else if (sscanf(argv[i], "--rollup-query-format=%n", &end) == 0 && end != 0) {
             config.query_format = argv[i] + end;
-        } else if (sscanf(argv[i], "--lambda-virtual-start=0x%" SCNx64 "%n", &config.lambda_virtual_start, &end) == 1 &&
-            argv[i][end] == 0) {
-            ;
-        } else if (sscanf(argv[i], "--lambda-virtual-start=%" SCNu64 "%n", &config.lambda_virtual_start, &end) == 1 &&
-            argv[i][end] == 0) {
-            ;
         } else if (sscanf(argv[i], "--rollup-input-begin=%d%n", &config.input_begin, &end) == 1 && argv[i][end] == 0) {
             ;
         } else if (sscanf(argv[i], "--rollup-input-end=%d%n", &config.input_end, &end) == 1 && argv[i][end] == 0) {
@@ -602,41 +1606,74 @@ int main(int argc, char *argv[]) {
             return 1;
         }
     }
+    // a shared image can be torn by a crash whatever the policy, and amortizing flushes would only widen the tear
+    if (config.lambda_durability.what != lambda_durability_what::input && !config.journal_filename) {
+        (void) fprintf(stderr, "[dapp] --lambda-flush other than input needs --journal-filename\n");
+        return 1;
+    }
     rollup_state_type *rollup_state = rollup_open(config);
     if (!rollup_state) {
         (void) fprintf(stderr, "[dapp] unable to initialize rollup\n");
         return 1;
     }
-    lambda_type *lambda = reinterpret_cast<lambda_type *>(rollup_state->lambda);
-    g_arena = &lambda->arena;
-    if (initialize_lambda) {
-        memset(lambda, 0, rollup_state->lambda_length);
-        new (&lambda->arena) memory_arena(rollup_state->lambda_length -
-            (reinterpret_cast<char *>(&lambda->arena) - reinterpret_cast<char *>(lambda)));
-        new (&lambda->ex) perna::exchange();
+    auto *lambda = import_filename ? import_lambda_state(rollup_state, import_filename)
+                                   : open_lambda(rollup_state, initialize_lambda);
+    if (!lambda) {
+        (void) fprintf(stderr, "[dapp] unable to open lambda\n");
+        return 1;
     }
-    return rollup_request_loop<lambda_type, input_type, query_type>(rollup_state, advance_state, inspect_state);
+    if (import_filename) {
+        // every later input builds on the imported lambda, so it is made durable right away, which also checkpoints
+        // it and drops the inputs journaled for the previous one
+        if (!flush_dirty_lambda(rollup_state, lambda)) {
+            return 1;
+        }
+    } else if (initialize_lambda) {
+        // checkpoint the new lambda, which also drops the inputs journaled for the previous one
+        if (rollup_state->journal.is_open() && !flush_dirty_lambda(rollup_state, lambda)) {
+            return 1;
+        }
+    }
+    // Bring the lambda back to where it was before a crash from the inputs journaled after its checkpoint
+    if (!rollup_replay_journal<lambda_type, input_type>(rollup_state, advance_state, lambda->input_count)) {
+        (void) fprintf(stderr, "[dapp] unable to replay journal\n");
+        return 1;
+    }
+    // Checkpoint the replayed inputs in one go, now that the journal is no longer read
+    flush_unflushed_inputs(rollup_state, reinterpret_cast<lambda_type *>(rollup_state->lambda));
+    // Give inspect servers the lambda as it stands before the first input
+    publish_lambda(rollup_state, reinterpret_cast<lambda_type *>(rollup_state->lambda));
+    auto result =
+        rollup_request_loop<lambda_type, input_type, query_type>(rollup_state, advance_state, inspect_state);
+    lambda = reinterpret_cast<lambda_type *>(rollup_state->lambda);
+    // Commit whatever the durability policy left unflushed, and publish whatever the snapshot interval left out
+    flush_unflushed_inputs(rollup_state, lambda);
+    if (rollup_state->unpublished_input_count != 0) {
+        publish_lambda(rollup_state, lambda);
+    }
+    // Export the state the lambda reached, for new nodes to import instead of replaying every input
+    if (export_filename && !export_lambda_state(lambda, export_filename)) {
+        return 1;
+    }
+    return result;
 }
 #endif
 
 #ifdef JSONRPC_SERVER
 int main(int argc, char *argv[]) {
     rollup_config_type config;
-    config.lambda_virtual_start = LAMBDA_VIRTUAL_START;
     bool initialize_lambda = false;
     int end = 0;
     for (int i = 1; i < argc; ++i) {
         end = 0;
         if (sscanf(argv[i], "--image-filename=%n", &end) == 0 && end != 0) {
             config.image_filename = argv[i] + end;
+        } else if (strcmp(argv[i], "--lambda-huge-pages") == 0) {
+            config.lambda_mapping.huge_pages = true;
+        } else if (strcmp(argv[i], "--lambda-prefault") == 0) {
+            config.lambda_mapping.prefault = true;
         } else if (sscanf(argv[i], "--server-address=%n", &end) == 0 && end != 0) {
             config.server_address = argv[i] + end;
-        } else if (sscanf(argv[i], "--lambda-virtual-start=0x%" SCNx64 "%n", &config.lambda_virtual_start, &end) == 1 &&
-            argv[i][end] == 0) {
-            ;
-        } else if (sscanf(argv[i], "--lambda-virtual-start=%" SCNu64 "%n", &config.lambda_virtual_start, &end) == 1 &&
-            argv[i][end] == 0) {
-            ;
         } else if (strcmp(argv[i], "--initialize-lambda") == 0) {
             initialize_lambda = true;
         } else {
@@ -649,13 +1686,9 @@ int main(int argc, char *argv[]) {
         (void) fprintf(stderr, "[dapp] unable to initialize rollup\n");
         return 1;
     }
-    lambda_type *lambda = reinterpret_cast<lambda_type *>(rollup_state->lambda);
-    g_arena = &lambda->arena;
-    if (initialize_lambda) {
-        memset(lambda, 0, rollup_state->lambda_length);
-        new (&lambda->arena) memory_arena(rollup_state->lambda_length -
-            (reinterpret_cast<char *>(&lambda->arena) - reinterpret_cast<char *>(lambda)));
-        new (&lambda->ex) perna::exchange();
+    if (!open_lambda(rollup_state, initialize_lambda)) {
+        (void) fprintf(stderr, "[dapp] unable to open lambda\n");
+        return 1;
     }
     return rollup_request_loop<lambda_type, input_type, query_type>(rollup_state, advance_state, inspect_state);
 }
@@ -0,0 +1,187 @@
+#ifndef INPUT_JOURNAL_H
+#define INPUT_JOURNAL_H
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// Write-ahead journal of the inputs advanced since the lambda was last checkpointed
+
+// Every input is appended to the journal before it is processed, as the metadata and payload handed to advance
+// state. The journal is synced once per group of inputs, and before the first output of an input is written, so no
+// output outlives a crash that its input does not. With a journal, the image file only changes when the lambda is
+// checkpointed, so after a crash it holds the last checkpoint and the journal holds the inputs to replay on top of
+// it. Records are numbered by how many inputs the lambda had taken before them, so replay skips the records a
+// checkpoint already holds if the crash came before the journal was emptied. A record cut short by the crash fails
+// its checksum and ends the replay.
+
+struct journal_record_header_type {
+    uint64_t sequence;        // inputs advanced before this one
+    uint64_t checksum;        // of the rest of the header and the data that follows it
+    int32_t input_index;      // index of the input in the rollup, which names its outputs
+    uint32_t metadata_length; // bytes of metadata that follow the header
+    uint32_t payload_length;  // bytes of payload that follow the metadata
+    uint32_t reserved;
+};
+
+// A record read back from the journal
+struct journal_record_type {
+    journal_record_header_type header;
+    const unsigned char *metadata;
+    const unsigned char *payload;
+};
+
+class input_journal_type {
+    int m_fd{-1};
+    uint64_t m_group{1};
+    uint64_t m_unsynced{0};
+
+    // FNV-1a, enough to tell a record cut short from a whole one
+    static uint64_t checksum(uint64_t hash, const void *data, size_t length) {
+        const auto *bytes = static_cast<const unsigned char *>(data);
+        for (size_t i = 0; i < length; ++i) {
+            hash = (hash ^ bytes[i]) * UINT64_C(0x100000001b3);
+        }
+        return hash;
+    }
+
+    static uint64_t checksum(const journal_record_header_type &header, const void *metadata, const void *payload) {
+        auto h = header;
+        h.checksum = 0;
+        auto hash = checksum(UINT64_C(0xcbf29ce484222325), &h, sizeof(h));
+        hash = checksum(hash, metadata, header.metadata_length);
+        return checksum(hash, payload, header.payload_length);
+    }
+
+public:
+    input_journal_type() = default;
+    input_journal_type(const input_journal_type &) = delete;
+    input_journal_type &operator=(const input_journal_type &) = delete;
+
+    ~input_journal_type() {
+        if (m_fd >= 0) {
+            close(m_fd);
+        }
+    }
+
+    // Open the journal at filename, creating it if needed, to be synced once every group inputs
+    bool open(const char *filename, uint64_t group) {
+        m_fd = ::open(filename, O_RDWR | O_CREAT | O_APPEND, 0644);
+        if (m_fd < 0) {
+            (void) fprintf(stderr, "[dapp] unable to open journal '%s' (%s)\n", filename, strerror(errno));
+            return false;
+        }
+        m_group = group;
+        return true;
+    }
+
+    bool is_open() const {
+        return m_fd >= 0;
+    }
+
+    // Append an input, syncing the journal once a whole group of inputs is waiting
+    bool append(uint64_t sequence, int input_index, const void *metadata, uint32_t metadata_length,
+        const void *payload, uint32_t payload_length) {
+        journal_record_header_type header{.sequence = sequence,
+            .checksum = 0,
+            .input_index = input_index,
+            .metadata_length = metadata_length,
+            .payload_length = payload_length,
+            .reserved = 0};
+        header.checksum = checksum(header, metadata, payload);
+        iovec parts[] = {{&header, sizeof(header)}, {const_cast<void *>(metadata), metadata_length},
+            {const_cast<void *>(payload), payload_length}};
+        auto length = sizeof(header) + metadata_length + payload_length;
+        auto written = writev(m_fd, parts, 3);
+        if (written < 0 || static_cast<size_t>(written) != length) {
+            (void) fprintf(stderr, "[dapp] unable to append to journal (%s)\n", strerror(errno));
+            return false;
+        }
+        if (++m_unsynced >= m_group) {
+            return sync();
+        }
+        return true;
+    }
+
+    // Make every input appended so far durable
+    bool sync() {
+        if (m_unsynced == 0) {
+            return true;
+        }
+        if (fdatasync(m_fd) < 0) {
+            (void) fprintf(stderr, "[dapp] unable to sync journal (%s)\n", strerror(errno));
+            return false;
+        }
+        m_unsynced = 0;
+        return true;
+    }
+
+    // Drop every record, once a checkpoint holds them all
+    bool clear() {
+        if (ftruncate(m_fd, 0) < 0 || fdatasync(m_fd) < 0) {
+            (void) fprintf(stderr, "[dapp] unable to empty journal (%s)\n", strerror(errno));
+            return false;
+        }
+        m_unsynced = 0;
+        return true;
+    }
+
+    // Visit every whole record in order as f(record), once whatever follows the last whole record was cut off so
+    // new records go right after it. The records are read beforehand, so f may checkpoint and clear the journal.
+    // Returns false if the journal cannot be read.
+    template <typename F>
+    bool replay(F &&f) {
+        auto length = lseek(m_fd, 0, SEEK_END);
+        if (length < 0) {
+            (void) fprintf(stderr, "[dapp] unable to get length of journal (%s)\n", strerror(errno));
+            return false;
+        }
+        std::vector<unsigned char> data(static_cast<size_t>(length));
+        for (size_t done = 0; done < data.size();) {
+            auto n = pread(m_fd, data.data() + done, data.size() - done, static_cast<off_t>(done));
+            if (n <= 0) {
+                (void) fprintf(stderr, "[dapp] unable to read journal (%s)\n", strerror(errno));
+                return false;
+            }
+            done += static_cast<size_t>(n);
+        }
+        std::vector<journal_record_type> records;
+        size_t offset = 0;
+        while (data.size() - offset >= sizeof(journal_record_header_type)) {
+            journal_record_type record{};
+            std::memcpy(&record.header, data.data() + offset, sizeof(record.header));
+            auto data_length = static_cast<size_t>(record.header.metadata_length) + record.header.payload_length;
+            if (data.size() - offset - sizeof(record.header) < data_length) {
+                break;
+            }
+            record.metadata = data.data() + offset + sizeof(record.header);
+            record.payload = record.metadata + record.header.metadata_length;
+            if (checksum(record.header, record.metadata, record.payload) != record.header.checksum) {
+                break;
+            }
+            records.push_back(record);
+            offset += sizeof(record.header) + data_length;
+        }
+        if (offset != data.size()) {
+            (void) fprintf(stderr, "[dapp] dropping %zu bytes of incomplete journal record\n", data.size() - offset);
+            if (ftruncate(m_fd, static_cast<off_t>(offset)) < 0) {
+                (void) fprintf(stderr, "[dapp] unable to cut journal short (%s)\n", strerror(errno));
+                return false;
+            }
+        }
+        for (const auto &record : records) {
+            f(record);
+        }
+        return true;
+    }
+};
+
+#endif
@@ -53,6 +53,10 @@ static std::ostream &operator<<(std::ostream &out, const be256 &s) {
 static constexpr eth_address ERC20_PORTAL_ADDRESS{0x9C, 0x21, 0xAE, 0xb2, 0x09, 0x3C, 0x32, 0xDD, 0xbC, 0x53, 0xeE,
     0xF2, 0x4B, 0x87, 0x3B, 0xDC, 0xd1, 0xaD, 0xa1, 0xDB};
 
+// Operator account, the only sender allowed to send admin inputs
+static constexpr eth_address ADMIN_ADDRESS{0xf3, 0x9F, 0xd6, 0xe5, 0x1a, 0xad, 0x88, 0xF6, 0xF4, 0xce, 0x6a, 0xB8, 0x82,
+    0x72, 0x79, 0xcf, 0xfF, 0xb9, 0x22, 0x66};
+
 static constexpr eth_address ADA_ADDRESS{0xc6, 0xe7, 0xDF, 0x5E, 0x7b, 0x4f, 0x2A, 0x27, 0x89, 0x06, 0x86, 0x2b, 0x61, 0x20, 0x58, 0x50, 0x34, 0x4D, 0x4e, 0x7d};
 
 static constexpr eth_address BNB_ADDRESS{0x59, 0xb6, 0x70, 0xe9, 0xfA, 0x9D, 0x0A, 0x42, 0x77, 0x51, 0xAf, 0x20, 0x1D, 0x67, 0x67, 0x19, 0xa9, 0x70, 0x85, 0x7b};
@@ -182,6 +186,8 @@ enum class event_what : char {
     execution = 'E',                    // trade execution (partial or full)
     rejection_invalid_symbol = 'r',     // order rejection
     rejection_insufficient_funds = 'R', // order rejection
+    rejection_invalid_id = 'i',         // cancel rejection, no such resting order for this trader
+    rejection_unfillable = 'k',         // order rejection, fill-or-kill order cannot be filled entirely
 };
 
 static std::ostream &operator<<(std::ostream &out, const event_what &s) {
@@ -201,6 +207,56 @@ static std::ostream &operator<<(std::ostream &out, const event_what &s) {
         case event_what::rejection_invalid_symbol:
             out << "rejection_invalid_symbol";
             break;
+        case event_what::rejection_invalid_id:
+            out << "rejection_invalid_id";
+            break;
+        case event_what::rejection_unfillable:
+            out << "rejection_unfillable";
+            break;
+        default:
+            out << "unknown";
+            break;
+    }
+    return out;
+}
+
+enum class order_kind_what : char {
+    limit = 'L',  // trades at price or better
+    market = 'M', // trades at whatever price the book offers, price is ignored
+};
+
+static std::ostream &operator<<(std::ostream &out, const order_kind_what &s) {
+    switch (s) {
+        case order_kind_what::limit:
+            out << "limit";
+            break;
+        case order_kind_what::market:
+            out << "market";
+            break;
+        default:
+            out << "unknown";
+            break;
+    }
+    return out;
+}
+
+enum class time_in_force_what : char {
+    good_till_cancel = 'G',    // remaining quantity rests in the book
+    immediate_or_cancel = 'I', // remaining quantity is cancelled
+    fill_or_kill = 'F',        // order is rejected unless it can be filled entirely at once
+};
+
+static std::ostream &operator<<(std::ostream &out, const time_in_force_what &s) {
+    switch (s) {
+        case time_in_force_what::good_till_cancel:
+            out << "good_till_cancel";
+            break;
+        case time_in_force_what::immediate_or_cancel:
+            out << "immediate_or_cancel";
+            break;
+        case time_in_force_what::fill_or_kill:
+            out << "fill_or_kill";
+            break;
         default:
             out << "unknown";
             break;
@@ -208,11 +264,15 @@ static std::ostream &operator<<(std::ostream &out, const event_what &s) {
     return out;
 }
 
+// Inputs that predate kind and time_in_force leave them zeroed, which stands for a good-till-cancel limit order.
+// Market orders never rest in the book, so good-till-cancel is taken as immediate-or-cancel for them.
 struct new_order_input_type {
     symbol_type symbol;
     side_what side;
     quantity_type quantity;
     currency_type price;
+    order_kind_what kind;
+    time_in_force_what time_in_force;
 } __attribute__((packed));
 
 static std::ostream &operator<<(std::ostream &out, const new_order_input_type &s) {
@@ -220,7 +280,9 @@ static std::ostream &operator<<(std::ostream &out, const new_order_input_type &s
     out << "symbol:" << s.symbol << ',';
     out << "side:" << s.side << ',';
     out << "quantity:" << s.quantity << ',';
-    out << "price:" << s.price;
+    out << "price:" << s.price << ',';
+    out << "kind:" << s.kind << ',';
+    out << "time_in_force:" << s.time_in_force;
     out << "}";
     return out;
 }
@@ -249,7 +311,61 @@ static std::ostream &operator<<(std::ostream &out, const withdraw_input_type &s)
     return out;
 }
 
-enum class user_input_what : char { new_order = 'N', cancel_order = 'C', withdraw = 'W' };
+enum class user_input_what : char {
+    new_order = 'N',
+    cancel_order = 'C',
+    withdraw = 'W',
+    batch = 'B',
+    compact_arena = 'A', // admin only, takes no arguments
+};
+
+// One operation inside a batch input
+struct batch_entry_type {
+    user_input_what what; // new_order, cancel_order, or withdraw
+    union {
+        new_order_input_type new_order;
+        cancel_order_input_type cancel_order;
+        withdraw_input_type withdraw;
+    };
+} __attribute__((packed));
+
+static std::ostream &operator<<(std::ostream &out, const batch_entry_type &s) {
+    switch (s.what) {
+        case user_input_what::new_order:
+            out << s.new_order;
+            break;
+        case user_input_what::cancel_order:
+            out << s.cancel_order;
+            break;
+        case user_input_what::withdraw:
+            out << s.withdraw;
+            break;
+        default:
+            out << "unknown";
+            break;
+    }
+    return out;
+}
+
+// Operations from a single sender, applied in order within one advance request.
+// Only the first entry_count entries need to be present in the input payload.
+constexpr uint64_t MAX_BATCH_ENTRY = 64;
+struct batch_input_type {
+    uint64_t entry_count;
+    std::array<batch_entry_type, MAX_BATCH_ENTRY> entries;
+} __attribute__((packed));
+
+static std::ostream &operator<<(std::ostream &out, const batch_input_type &s) {
+    out << "batch_input_type{";
+    out << "entry_count:" << s.entry_count << ',';
+    out << "entries:{";
+    for (unsigned i = 0; i < std::min(s.entry_count, MAX_BATCH_ENTRY); ++i) {
+        out << s.entries[i] << ',';
+    }
+    out << "}";
+    out << "}";
+    return out;
+}
 
 struct user_input_type {
     user_input_what what;
@@ -257,6 +373,7 @@ struct user_input_type {
         new_order_input_type new_order;
         cancel_order_input_type cancel_order;
         withdraw_input_type withdraw;
+        batch_input_type batch;
     };
 } __attribute__((packed));
 
@@ -265,7 +382,8 @@ struct input_type {
     union {
         // This is an input coming from ERC20_PORTAL_ADDRESS and must be a deposit
         erc20_deposit_input_type erc20_deposit;
-        // This is an input coming from random users, and can be a new_order, a cancel_order, or a withdraw
+        // This is an input coming from random users, and can be a new_order, a cancel_order, a withdraw, or a batch,
+        // or a compact_arena coming from ADMIN_ADDRESS
         user_input_type user;
     };
 } __attribute__((packed));
@@ -281,8 +399,6 @@ struct execution_notice_type {
     currency_type price;
 } __attribute__((packed));
 
-using execution_notices_type = std::vector<execution_notice_type>;
-
 static std::ostream &operator<<(std::ostream &out, const execution_notice_type &s) {
     out << "execution_notice_type{";
     out << "trader:" << s.trader << ',';
@@ -311,7 +427,13 @@ static std::ostream &operator<<(std::ostream &out, const wallet_notice_type &s)
     return out;
 }
 
-enum class notice_what : char { execution = 'E', wallet_withdraw = 'W', wallet_deposit = 'D' };
+enum class notice_what : char {
+    execution = 'E',
+    wallet_withdraw = 'W',
+    wallet_deposit = 'D',
+    execution_batch = 'B',
+    arena_compaction = 'A',
+};
 
 struct notice_type {
     notice_what what;
@@ -321,9 +443,53 @@ struct notice_type {
     };
 } __attribute__((packed));
 
+// Execution notices resulting from a batch input, packed into a single notice.
+// Only the first entry_count entries are emitted.
+constexpr uint64_t MAX_EXECUTION_BATCH_ENTRY = 128;
+struct execution_batch_notice_type {
+    notice_what what; // always execution_batch
+    uint64_t entry_count;
+    std::array<execution_notice_type, MAX_EXECUTION_BATCH_ENTRY> entries;
+} __attribute__((packed));
+
+// How fragmented the arena is at one point in time
+struct arena_fragmentation_type {
+    uint64_t used;             // bytes carved so far, live or free
+    uint64_t live;             // bytes in live blocks
+    uint64_t free_list;        // bytes in free blocks waiting for reuse
+    uint64_t free_block_count; // free blocks waiting for reuse
+} __attribute__((packed));
+
+static std::ostream &operator<<(std::ostream &out, const arena_fragmentation_type &s) {
+    out << "arena_fragmentation_type{";
+    out << "used:" << s.used << ',';
+    out << "live:" << s.live << ',';
+    out << "free_list:" << s.free_list << ',';
+    out << "free_block_count:" << s.free_block_count;
+    out << "}";
+    return out;
+}
+
+// Issued whenever the arena is compacted, whether asked by the admin or at an epoch boundary
+struct arena_compaction_notice_type {
+    notice_what what; // always arena_compaction
+    arena_fragmentation_type before;
+    arena_fragmentation_type after;
+} __attribute__((packed));
+
+static std::ostream &operator<<(std::ostream &out, const arena_compaction_notice_type &s) {
+    out << "arena_compaction_notice_type{";
+    out << "before:" << s.before << ',';
+    out << "after:" << s.after;
+    out << "}";
+    return out;
+}
+
 enum class query_what : char {
     book = 'B',
     wallet = 'W',
+    book_levels = 'L',
+    arena = 'A',
 };
 
 struct book_query_type {
@@ -339,6 +505,9 @@ static std::ostream &operator<<(std::ostream &out, const book_query_type &s) {
     return out;
 }
 
+// Aggregated price levels, depth levels on each side
+using book_levels_query_type = book_query_type;
+
 struct wallet_query_type {
     trader_type trader;
 } __attribute__((packed));
@@ -355,6 +524,7 @@ struct query_type {
     union {
         book_query_type book;
         wallet_query_type wallet;
+        book_levels_query_type book_levels;
     };
 } __attribute__((packed));
 
@@ -362,6 +532,8 @@ static std::ostream &operator<<(std::ostream &out, const query_type &s) {
     out << "query{";
     if (s.what == query_what::wallet) {
         out << s.wallet;
+    } else if (s.what == query_what::book_levels) {
+        out << s.book_levels;
     } else {
         out << s.book;
     }
@@ -409,6 +581,50 @@ static std::ostream &operator<<(std::ostream &out, const book_report_type &s) {
     return out;
 }
 
+// This is a report in answer to a book levels query
+struct book_level_entry_type {
+    currency_type price;
+    quantity_type quantity; // remaining quantity of all orders at price
+    uint64_t order_count;
+} __attribute__((packed));
+
+static std::ostream &operator<<(std::ostream &out, const book_level_entry_type &s) {
+    out << "book_level_entry_type{";
+    out << "price:" << s.price << ',';
+    out << "quantity:" << s.quantity << ',';
+    out << "order_count:" << s.order_count;
+    out << "}";
+    return out;
+}
+
+constexpr uint64_t MAX_BOOK_LEVEL = 32;
+struct book_levels_report_type {
+    symbol_type symbol;
+    uint64_t bid_count;
+    uint64_t ask_count;
+    std::array<book_level_entry_type, MAX_BOOK_LEVEL> bids; // best bid first
+    std::array<book_level_entry_type, MAX_BOOK_LEVEL> asks; // best ask first
+} __attribute__((packed));
+
+static std::ostream &operator<<(std::ostream &out, const book_levels_report_type &s) {
+    out << "book_levels_report_type{";
+    out << "symbol:" << s.symbol << ',';
+    out << "bid_count:" << s.bid_count << ',';
+    out << "ask_count:" << s.ask_count << ',';
+    out << "bids:{";
+    for (unsigned i = 0; i < s.bid_count; ++i) {
+        out << s.bids[i] << ',';
+    }
+    out << "},";
+    out << "asks:{";
+    for (unsigned i = 0; i < s.ask_count; ++i) {
+        out << s.asks[i] << ',';
+    }
+    out << "}";
+    out << "}";
+    return out;
+}
+
 struct wallet_entry_type {
     token_type token;
     quantity_type quantity;
@@ -441,6 +657,48 @@ static std::ostream &operator<<(std::ostream &out, const wallet_report_type &s)
     return out;
 }
 
+// Live arena blocks of one kind
+struct arena_usage_entry_type {
+    uint64_t bytes; // rounded up to the block size classes
+    uint64_t block_count;
+} __attribute__((packed));
+
+static std::ostream &operator<<(std::ostream &out, const arena_usage_entry_type &s) {
+    out << "arena_usage_entry_type{";
+    out << "bytes:" << s.bytes << ',';
+    out << "block_count:" << s.block_count;
+    out << "}";
+    return out;
+}
+
+// This is a report in answer to an arena query, which takes no arguments
+struct arena_report_type {
+    uint64_t capacity;        // bytes available to the arena
+    uint64_t used;            // bytes carved so far, live or free
+    uint64_t live;            // bytes in live blocks
+    uint64_t high_watermark;  // most bytes ever live at once
+    uint64_t free_list;       // bytes in free blocks waiting for reuse
+    arena_usage_entry_type order_nodes;  // resting orders and the order index
+    arena_usage_entry_type book_nodes;   // price levels
+    arena_usage_entry_type wallet_nodes; // balances and interned addresses
+    arena_usage_entry_type other;
+} __attribute__((packed));
+
+static std::ostream &operator<<(std::ostream &out, const arena_report_type &s) {
+    out << "arena_report_type{";
+    out << "capacity:" << s.capacity << ',';
+    out << "used:" << s.used << ',';
+    out << "live:" << s.live << ',';
+    out << "high_watermark:" << s.high_watermark << ',';
+    out << "free_list:" << s.free_list << ',';
+    out << "order_nodes:" << s.order_nodes << ',';
+    out << "book_nodes:" << s.book_nodes << ',';
+    out << "wallet_nodes:" << s.wallet_nodes << ',';
+    out << "other:" << s.other;
+    out << "}";
+    return out;
+}
+
 using report_what = query_what;
 
 struct report_type {
@@ -448,6 +706,8 @@ struct report_type {
     union {
         book_report_type book;
         wallet_report_type wallet;
+        book_levels_report_type book_levels;
+        arena_report_type arena;
     };
 } __attribute__((packed));
 
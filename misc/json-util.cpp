@@ -277,6 +277,10 @@ void ju_get_opt_field(const nlohmann::json &j, const K &key, query_what &value,
         value = query_what::book;
     } else if (what == "wallet") {
         value = query_what::wallet;
+    } else if (what == "book_levels") {
+        value = query_what::book_levels;
+    } else if (what == "arena") {
+        value = query_what::arena;
     } else {
         throw std::invalid_argument("field \""s + path + to_string(key) + "\" not a query_what");
     }
@@ -298,9 +302,12 @@ void ju_get_opt_field(const nlohmann::json &j, const K &key, query_type &value,
     ju_get_field(query, "what"s, value.what, new_path);
     if (value.what == query_what::book) {
         ju_get_field(query, "book"s, value.book, new_path);
-    } else {
+    } else if (value.what == query_what::book_levels) {
+        ju_get_field(query, "book_levels"s, value.book_levels, new_path);
+    } else if (value.what == query_what::wallet) {
         ju_get_field(query, "wallet"s, value.wallet, new_path);
     }
+    // arena queries take no arguments
 }
 
 template void ju_get_opt_field<uint64_t>(const nlohmann::json &j, const uint64_t &key, query_type &value,
@@ -341,6 +348,12 @@ void to_json(nlohmann::json &j, const report_what &what) {
         case report_what::wallet:
             j = "wallet";
             break;
+        case report_what::book_levels:
+            j = "book_levels";
+            break;
+        case report_what::arena:
+            j = "arena";
+            break;
         default:
             j = "uknown";
             break;
@@ -371,9 +384,40 @@ void to_json(nlohmann::json &j, const book_report_type &book_report) {
     j = nlohmann::json{{"symbol", encode_symbol(book_report.symbol)}, {"entries", entries}};
 }
 
+void to_json(nlohmann::json &j, const book_level_entry_type &entry) {
+    j = nlohmann::json{{"price", entry.price}, {"quantity", entry.quantity}, {"order_count", entry.order_count}};
+}
+
+void to_json(nlohmann::json &j, const book_levels_report_type &book_levels_report) {
+    nlohmann::json bids = nlohmann::json::array();
+    std::transform(&book_levels_report.bids[0],
+        &book_levels_report.bids[std::min(MAX_BOOK_LEVEL, book_levels_report.bid_count)], std::back_inserter(bids),
+        [](const book_level_entry_type &e) -> nlohmann::json { return e; });
+    nlohmann::json asks = nlohmann::json::array();
+    std::transform(&book_levels_report.asks[0],
+        &book_levels_report.asks[std::min(MAX_BOOK_LEVEL, book_levels_report.ask_count)], std::back_inserter(asks),
+        [](const book_level_entry_type &e) -> nlohmann::json { return e; });
+    j = nlohmann::json{{"symbol", encode_symbol(book_levels_report.symbol)}, {"bids", bids}, {"asks", asks}};
+}
+
+void to_json(nlohmann::json &j, const arena_usage_entry_type &entry) {
+    j = nlohmann::json{{"bytes", entry.bytes}, {"block_count", entry.block_count}};
+}
+
+void to_json(nlohmann::json &j, const arena_report_type &arena_report) {
+    j = nlohmann::json{{"capacity", arena_report.capacity}, {"used", arena_report.used}, {"live", arena_report.live},
+        {"high_watermark", arena_report.high_watermark}, {"free_list", arena_report.free_list},
+        {"order_nodes", arena_report.order_nodes}, {"book_nodes", arena_report.book_nodes},
+        {"wallet_nodes", arena_report.wallet_nodes}, {"other", arena_report.other}};
+}
+
 void to_json(nlohmann::json &j, const report_type &report) {
     if (report.what == report_what::book) {
         j = nlohmann::json{{"what", report.what}, {"book", report.book}};
+    } else if (report.what == report_what::book_levels) {
+        j = nlohmann::json{{"what", report.what}, {"book_levels", report.book_levels}};
+    } else if (report.what == report_what::arena) {
+        j = nlohmann::json{{"what", report.what}, {"arena", report.arena}};
     } else {
         j = nlohmann::json{{"what", report.what}, {"wallet", report.wallet}};
     }
@@ -171,6 +171,10 @@ void to_json(nlohmann::json &j, const side_what &what);
 void to_json(nlohmann::json &j, const report_what &what);
 void to_json(nlohmann::json &j, const book_report_type &book_report);
 void to_json(nlohmann::json &j, const book_entry_type &entry);
+void to_json(nlohmann::json &j, const book_levels_report_type &book_levels_report);
+void to_json(nlohmann::json &j, const book_level_entry_type &entry);
+void to_json(nlohmann::json &j, const arena_report_type &arena_report);
+void to_json(nlohmann::json &j, const arena_usage_entry_type &entry);
 void to_json(nlohmann::json &j, const wallet_report_type &wallet_report);
 void to_json(nlohmann::json &j, const wallet_entry_type &entry);
 void to_json(nlohmann::json &j, const report_type &report);
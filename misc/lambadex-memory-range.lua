@@ -65,8 +65,11 @@ JSON object to stdout.
           "symbol": <string>,
           "side": "buy" | "sell",
           "quantity": <number>,
-          "price": <number>
+          "price": <number>,
+          "kind": "limit" | "market",
+          "time_in_force": "good-till-cancel" | "immediate-or-cancel" | "fill-or-kill"
         }
+      kind defaults to "limit" and time_in_force to "good-till-cancel"
 
     lambadex-cancel-order-input
       the JSON repsentation is
@@ -81,6 +84,21 @@ JSON object to stdout.
           "quantity": <number>
         }
 
+    lambadex-batch-input
+      the JSON repsentation is
+        {
+          "entries": [
+            { "what": "new-order", <lambadex-new-order-input fields> } |
+            { "what": "cancel-order", <lambadex-cancel-order-input fields> } |
+            { "what": "withdraw", <lambadex-withdraw-input fields> }, ...
+          ]
+        }
+
+    lambadex-compact-arena-input
+      the JSON representation is
+        {}
+      only accepted from the admin address
+
     query
       the JSON representation is
         {"payload": <string> }
@@ -92,6 +110,18 @@ JSON object to stdout.
           "depth": <number>
         }
 
+    lambadex-book-levels-query
+      the JSON representation is
+        {
+          "symbol": <string>,
+          "depth": <number>
+        }
+      depth is the number of price levels on each side
+
+    lambadex-arena-query
+      the JSON representation is
+        {}
+
     lambadex-wallet-query
       the JSON representation is
         {
@@ -119,7 +149,8 @@ JSON object to stdout.
         {
           "trader": <eth-address>,
           "event": "new-order" | "cancel-order" | "execution" |
-                   "rejection-insuficient-funds" | "rejection-invalid-symbol",
+                   "rejection-insuficient-funds" | "rejection-invalid-symbol" |
+                   "rejection-invalid-id" | "rejection-unfillable",
           "id": <number>,
           "symbol": <string>,
           "side": "buy" | "sell",
@@ -127,6 +158,12 @@ JSON object to stdout.
           "price": <number>
         }
 
+    lambadex-execution-batch-notice
+      the JSON representation is
+        {
+          "entries": [ <lambadex-execution-notice>, ... ]
+        }
+
     lambadex-wallet-notice
       the JSON representation is
         {
@@ -136,6 +173,20 @@ JSON object to stdout.
           "quantity": <number>
         }
 
+    lambadex-arena-compaction-notice
+      the JSON representation is
+        {
+          "before": <lambadex-arena-fragmentation>,
+          "after": <lambadex-arena-fragmentation>
+        }
+      where <lambadex-arena-fragmentation> is
+        {
+          "used": <number>,
+          "live": <number>,
+          "free_list": <number>,
+          "free_block_count": <number>
+        }
+
     report
       the JSON representation is
         {"payload": <string> }
@@ -153,6 +204,28 @@ JSON object to stdout.
           }, ... ]
         }
 
+    lambadex-book-levels-report
+      the JSON representation is
+        {
+          "symbol": <string>,
+          "bids": [ { "price": <number>, "quantity": <number>, "order_count": <number> }, ... ],
+          "asks": [ { "price": <number>, "quantity": <number>, "order_count": <number> }, ... ]
+        }
+
+    lambadex-arena-report
+      the JSON representation is
+        {
+          "capacity": <number>,
+          "used": <number>,
+          "live": <number>,
+          "high_watermark": <number>,
+          "free_list": <number>,
+          "order_nodes": { "bytes": <number>, "block_count": <number> },
+          "book_nodes": { "bytes": <number>, "block_count": <number> },
+          "wallet_nodes": { "bytes": <number>, "block_count": <number> },
+          "other": { "bytes": <number>, "block_count": <number> }
+        }
+
     lambadex-wallet-report
       the JSON representation is
         {
@@ -254,18 +327,26 @@ local what_table = {
     ["lambadex-new-order-input"] = true,
     ["lambadex-cancel-order-input"] = true,
     ["lambadex-withdraw-input"] = true,
+    ["lambadex-batch-input"] = true,
+    ["lambadex-compact-arena-input"] = true,
     ["query"] = true,
     ["lambadex-book-query"] = true,
+    ["lambadex-book-levels-query"] = true,
+    ["lambadex-arena-query"] = true,
     ["lambadex-wallet-query"] = true,
     ["voucher"] = true,
     ["erc20-transfer-voucher"] = true,
     ["voucher-hashes"] = true,
     ["notice"] = true,
     ["lambadex-execution-notice"] = true,
+    ["lambadex-execution-batch-notice"] = true,
     ["lambadex-wallet-notice"] = true,
+    ["lambadex-arena-compaction-notice"] = true,
     ["notice-hashes"] = true,
     ["report"] = true,
     ["lambadex-book-report"] = true,
+    ["lambadex-book-levels-report"] = true,
+    ["lambadex-arena-report"] = true,
     ["lambadex-wallet-report"] = true,
 }
 
@@ -347,6 +428,8 @@ local encode_event_what_enum = {
     ["execution"] = "E",
     ["rejection-insufficient-funds"] = "R",
     ["rejection-invalid-symbol"] = "r",
+    ["rejection-invalid-id"] = "i",
+    ["rejection-unfillable"] = "k",
 }
 
 local decode_event_what_enum = {
@@ -355,6 +438,8 @@ local decode_event_what_enum = {
     ["E"] = "execution",
     ["R"] = "rejection-insufficient-funds",
     ["r"] = "rejection-invalid-symbol",
+    ["i"] = "rejection-invalid-id",
+    ["k"] = "rejection-unfillable",
 }
 
 local encode_erc20_deposit_status_enum = {
@@ -367,6 +452,17 @@ local encode_order_side_enum = {
     ["sell"] = "S"
 }
 
+local encode_order_kind_enum = {
+    ["limit"] = "L",
+    ["market"] = "M"
+}
+
+local encode_time_in_force_enum = {
+    ["good-till-cancel"] = "G",
+    ["immediate-or-cancel"] = "I",
+    ["fill-or-kill"] = "F"
+}
+
 local encode_wallet_notice_direction_enum = {
     ["deposit"] = "D",
     ["witdraw"] = "W"
@@ -516,6 +612,26 @@ local function encode_lambadex_book_query()
     io.stdout:write(payload)
 end
 
+local function encode_lambadex_book_levels_query()
+    local j = read_json()
+    local payload = table.concat{
+        'L',
+        string.pack("c10", assert(j.symbol, "missing symbol")),
+        string.pack("<I8", check_number(j.depth, "depth")),
+    }
+    write_be256(32)
+    write_be256(#payload)
+    io.stdout:write(payload)
+end
+
+local function encode_lambadex_arena_query()
+    read_json()
+    local payload = 'A'
+    write_be256(32)
+    write_be256(#payload)
+    io.stdout:write(payload)
+end
+
 local function decode_lambadex_book_query()
     assert(read_be256() == 32) -- skip offset
     local length = read_be256()
@@ -575,6 +691,103 @@ local function decode_lambadex_book_report()
     )
 end
 
+local MAX_BOOK_LEVEL = 32
+local function decode_lambadex_book_levels_report()
+    assert(read_be256() == 32) -- skip offset
+    local length = read_be256()
+    local what = read_byte()
+    assert(what == 'L', "not a book levels report")
+    local symbol = read_symbol()
+    local bid_count = read_uint64()
+    local ask_count = read_uint64()
+    local function read_levels(count)
+        local levels = {}
+        for i = 1, MAX_BOOK_LEVEL do
+            local price = read_uint64()
+            local quantity = read_uint64()
+            local order_count = read_uint64()
+            if i <= count then
+                levels[#levels+1] = {
+                    price = price,
+                    quantity = quantity,
+                    order_count = order_count
+                }
+            end
+        end
+        return levels
+    end
+    local bids = read_levels(bid_count)
+    local asks = read_levels(ask_count)
+    io.stdout:write(
+        json.encode({
+            symbol = symbol,
+            bids = bids,
+            asks = asks,
+        }, {
+            indent = true,
+            keyorder = {
+                "symbol",
+                "bids",
+                "asks",
+                "price",
+                "quantity",
+                "order_count",
+            },
+        }),
+        "\n"
+    )
+end
+
+local function decode_lambadex_arena_report()
+    assert(read_be256() == 32) -- skip offset
+    local length = read_be256()
+    local what = read_byte()
+    assert(what == 'A', "not an arena report")
+    local function read_usage()
+        local bytes = read_uint64()
+        local block_count = read_uint64()
+        return { bytes = bytes, block_count = block_count }
+    end
+    local capacity = read_uint64()
+    local used = read_uint64()
+    local live = read_uint64()
+    local high_watermark = read_uint64()
+    local free_list = read_uint64()
+    local order_nodes = read_usage()
+    local book_nodes = read_usage()
+    local wallet_nodes = read_usage()
+    local other = read_usage()
+    io.stdout:write(
+        json.encode({
+            capacity = capacity,
+            used = used,
+            live = live,
+            high_watermark = high_watermark,
+            free_list = free_list,
+            order_nodes = order_nodes,
+            book_nodes = book_nodes,
+            wallet_nodes = wallet_nodes,
+            other = other,
+        }, {
+            indent = true,
+            keyorder = {
+                "capacity",
+                "used",
+                "live",
+                "high_watermark",
+                "free_list",
+                "order_nodes",
+                "book_nodes",
+                "wallet_nodes",
+                "other",
+                "bytes",
+                "block_count",
+            },
+        }),
+        "\n"
+    )
+end
+
 local MAX_BOOK_ENTRY = 64
 local function encode_lambadex_book_report()
     local j = read_json()
@@ -716,6 +929,51 @@ local function decode_lambadex_execution_notice()
     )
 end
 
+local function decode_lambadex_execution_batch_notice()
+    assert(read_be256() == 32) -- skip offset
+    local length = read_be256()
+    local what = read_byte()
+    assert(what == 'B', "not an execution batch notice")
+    local entry_count = read_uint64()
+    local entries = {}
+    for i = 1, entry_count do
+        local trader = read_address20()
+        local event = read_byte()
+        local id = read_uint64()
+        local symbol = read_symbol()
+        local side = read_byte()
+        local quantity = read_uint64()
+        local price = read_uint64()
+        entries[#entries+1] = {
+            trader = hexhash(trader),
+            event = check_enum(event, decode_event_what_enum, "event"),
+            id = id,
+            symbol = symbol,
+            side = check_enum(side, decode_order_side_enum, "side"),
+            quantity = quantity,
+            price = price
+        }
+    end
+    io.stdout:write(
+        json.encode({
+            entries = entries,
+        }, {
+            indent = true,
+            keyorder = {
+                "entries",
+                "trader",
+                "event",
+                "id",
+                "symbol",
+                "side",
+                "quantity",
+                "price"
+            },
+        }),
+        "\n"
+    )
+end
+
 local function decode_lambadex_wallet_notice()
     assert(read_be256() == 32) -- skip offset
     local length = read_be256()
@@ -743,6 +1001,39 @@ local function decode_lambadex_wallet_notice()
     )
 end
 
+local function decode_lambadex_arena_compaction_notice()
+    assert(read_be256() == 32) -- skip offset
+    local length = read_be256()
+    local what = read_byte()
+    assert(what == 'A', "not an arena compaction notice")
+    local function read_fragmentation()
+        local used = read_uint64()
+        local live = read_uint64()
+        local free_list = read_uint64()
+        local free_block_count = read_uint64()
+        return { used = used, live = live, free_list = free_list, free_block_count = free_block_count }
+    end
+    local before = read_fragmentation()
+    local after = read_fragmentation()
+    io.stdout:write(
+        json.encode({
+            before = before,
+            after = after,
+        }, {
+            indent = true,
+            keyorder = {
+                "before",
+                "after",
+                "used",
+                "live",
+                "free_list",
+                "free_block_count",
+            },
+        }),
+        "\n"
+    )
+end
+
 local function decode_voucher()
     local destination = hexhash(read_address32())
     local offset = read_be256()
@@ -787,38 +1078,85 @@ local function encode_erc20_deposit_input()
     io.stdout:write(payload)
 end
 
-local function encode_lambadex_new_order_input()
-    local j = read_json()
-    local payload = table.concat{
+local function pack_lambadex_new_order(j)
+    return table.concat{
         'N',
         string.pack("c10", assert(j.symbol, "missing symbol")),
         check_enum(j.side, encode_order_side_enum, "side"),
         string.pack("<I8", check_number(j.quantity, "quantity")),
         string.pack("<I8", check_number(j.price, "price")),
+        check_enum(j.kind or "limit", encode_order_kind_enum, "kind"),
+        check_enum(j.time_in_force or "good-till-cancel", encode_time_in_force_enum, "time_in_force"),
     }
-    write_be256(32)
-    write_be256(#payload)
-    io.stdout:write(payload)
 end
 
-local function encode_lambadex_withdraw_input()
-    local j = read_json()
-    local payload = table.concat{
+local function pack_lambadex_withdraw(j)
+    return table.concat{
         'W',
         unhexhash(j.token, "token"),
         string.pack("<I8", check_number(j.quantity, "quantity")),
     }
+end
+
+local function pack_lambadex_cancel_order(j)
+    return table.concat{
+        'C',
+        string.pack("<I8", check_number(j.id, "id")),
+    }
+end
+
+local function encode_lambadex_new_order_input()
+    local payload = pack_lambadex_new_order(read_json())
+    write_be256(32)
+    write_be256(#payload)
+    io.stdout:write(payload)
+end
+
+local function encode_lambadex_withdraw_input()
+    local payload = pack_lambadex_withdraw(read_json())
     write_be256(32)
     write_be256(#payload)
     io.stdout:write(payload)
 end
 
 local function encode_lambadex_cancel_order_input()
+    local payload = pack_lambadex_cancel_order(read_json())
+    write_be256(32)
+    write_be256(#payload)
+    io.stdout:write(payload)
+end
+
+-- Every batch entry takes the size of the largest operation
+local MAX_BATCH_ENTRY = 64
+local BATCH_ENTRY_SIZE = 1 + 29
+local pack_lambadex_batch_entry = {
+    ["new-order"] = pack_lambadex_new_order,
+    ["cancel-order"] = pack_lambadex_cancel_order,
+    ["withdraw"] = pack_lambadex_withdraw,
+}
+
+local function encode_lambadex_batch_input()
     local j = read_json()
-    local payload = table.concat{
-        'C',
-        string.pack("<I8", check_number(j.id, "id")),
+    assert(type(j.entries) == "table", "missing entries")
+    local entry_count = #j.entries
+    assert(entry_count <= MAX_BATCH_ENTRY, "too many entries")
+    local payload_tab = {
+        'B',
+        string.pack("<I8", entry_count)
     }
+    for _, v in ipairs(j.entries) do
+        local entry = check_enum(v.what, pack_lambadex_batch_entry, "what")(v)
+        payload_tab[#payload_tab+1] = entry .. string.rep("\0", BATCH_ENTRY_SIZE - #entry)
+    end
+    local payload = table.concat(payload_tab)
+    write_be256(32)
+    write_be256(#payload)
+    io.stdout:write(payload)
+end
+
+local function encode_lambadex_compact_arena_input()
+    read_json()
+    local payload = 'A'
     write_be256(32)
     write_be256(#payload)
     io.stdout:write(payload)
@@ -966,10 +1304,14 @@ local action_what_table = {
     encode_lambadex_new_order_input = encode_lambadex_new_order_input,
     encode_lambadex_withdraw_input = encode_lambadex_withdraw_input,
     encode_lambadex_cancel_order_input = encode_lambadex_cancel_order_input,
+    encode_lambadex_batch_input = encode_lambadex_batch_input,
+    encode_lambadex_compact_arena_input = encode_lambadex_compact_arena_input,
     encode_erc20_transfer_voucher = encode_erc20_transfer_voucher,
     encode_query = encode_string,
     encode_lambadex_wallet_query = encode_lambadex_wallet_query,
     encode_lambadex_book_query = encode_lambadex_book_query,
+    encode_lambadex_book_levels_query = encode_lambadex_book_levels_query,
+    encode_lambadex_arena_query = encode_lambadex_arena_query,
     encode_voucher = encode_voucher,
     encode_notice = encode_string,
     encode_lambadex_execution_notice = encode_lambadex_execution_notice,
@@ -991,10 +1333,14 @@ local action_what_table = {
     decode_voucher = decode_voucher,
     decode_notice = decode_string,
     decode_lambadex_execution_notice = decode_lambadex_execution_notice,
+    decode_lambadex_execution_batch_notice = decode_lambadex_execution_batch_notice,
     decode_lambadex_wallet_notice = decode_lambadex_wallet_notice,
+    decode_lambadex_arena_compaction_notice = decode_lambadex_arena_compaction_notice,
     decode_exception = decode_string,
     decode_report = decode_string,
     decode_lambadex_book_report = decode_lambadex_book_report,
+    decode_lambadex_book_levels_report = decode_lambadex_book_levels_report,
+    decode_lambadex_arena_report = decode_lambadex_arena_report,
     decode_lambadex_wallet_report = decode_lambadex_wallet_report,
     decode_voucher_hashes = decode_hashes,
     decode_notice_hashes = decode_hashes,
@@ -0,0 +1,169 @@
+// Page faults and matching throughput of a lambda image under each mapping policy of the host backends.
+//
+// For every combination of --lambda-huge-pages and --lambda-prefault, the benchmark creates a sparse image file,
+// maps it the way the host backends do and places an arena at its start. It then
+//   - maps the image and applies the policy (map),
+//   - rests orders on a book with an order index, as the exchange does (rest),
+//   - and sweeps the whole book with aggressive buys that each fill several orders (match),
+// reporting the page faults taken and the time spent by each phase.
+// Huge pages only take effect where the filesystem backs shared mappings with them, such as tmpfs with
+// shmem_enabled set to advise, so point --image-filename to /dev/shm to see them.
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "io-types.h"
+#include "lambda-mapping.hpp"
+#include "memory-arena.hpp"
+#include "order-book.hpp"
+
+constexpr currency_type BASE_PRICE = 10000;
+
+struct phase_type {
+    uint64_t operations;
+    uint64_t minor_faults;
+    uint64_t major_faults;
+    double ms;
+};
+
+// Run f, counting the page faults it takes and how long it runs. f returns the number of operations it performed.
+template <typename F>
+static phase_type measure(F &&f) {
+    rusage before{};
+    rusage after{};
+    (void) getrusage(RUSAGE_SELF, &before);
+    auto start = std::chrono::steady_clock::now();
+    auto operations = f();
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    (void) getrusage(RUSAGE_SELF, &after);
+    return phase_type{operations, static_cast<uint64_t>(after.ru_minflt - before.ru_minflt),
+        static_cast<uint64_t>(after.ru_majflt - before.ru_majflt),
+        std::chrono::duration<double, std::milli>(elapsed).count()};
+}
+
+static void print_phase(const char *policy, const char *phase, const phase_type &p) {
+    (void) printf("%-10s %-6s %12" PRIu64 " %12" PRIu64 " %8" PRIu64 " %10.1f %10.1f\n", policy, phase, p.operations,
+        p.minor_faults, p.major_faults, p.ms, p.ms * 1e6 / static_cast<double>(std::max<uint64_t>(p.operations, 1)));
+}
+
+static bool run(const char *policy_name, const lambda_mapping_policy_type &policy, const char *image_filename,
+    uint64_t image_length, uint64_t orders, uint64_t levels) {
+    int fd = open(image_filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        (void) fprintf(stderr, "[bench] open failed for '%s' (%s)\n", image_filename, strerror(errno));
+        return false;
+    }
+    if (ftruncate(fd, static_cast<off_t>(image_length)) < 0) {
+        (void) fprintf(stderr, "[bench] unable to size image file (%s)\n", strerror(errno));
+        close(fd);
+        return false;
+    }
+    void *image = MAP_FAILED;
+    bool applied = false;
+    // every page of the image counts as one operation
+    auto map = measure([&] {
+        image = mmap(nullptr, image_length, PROT_WRITE | PROT_READ, MAP_SHARED, fd, 0);
+        applied = image != MAP_FAILED && apply_lambda_mapping_policy(policy, image, image_length);
+        return image_length / static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+    });
+    close(fd);
+    if (image == MAP_FAILED || !applied) {
+        (void) fprintf(stderr, "[bench] unable to map image (%s)\n", strerror(errno));
+        if (image != MAP_FAILED) {
+            munmap(image, image_length);
+        }
+        unlink(image_filename);
+        return false;
+    }
+    auto *arena = new (image) memory_arena(image_length);
+    perna::asks_type asks(arena);
+    perna::order_index_type index(arena);
+    std::mt19937_64 rng(orders * 31 + levels);
+    std::uniform_int_distribution<currency_type> price(BASE_PRICE, BASE_PRICE + levels - 1);
+    std::uniform_int_distribution<quantity_type> quantity(1, 100);
+    auto rest = measure([&] {
+        for (uint64_t i = 0; i < orders; ++i) {
+            auto p = price(rng);
+            perna::resting_order_type o{.id = i + 1, .quantity = quantity(rng), .price = p, .trader = 0};
+            index.insert(o.id, perna::order_location_type{asks.insert(o), 0, side_what::sell});
+        }
+        return orders;
+    });
+    auto match = measure([&] {
+        uint64_t fills = 0;
+        while (!asks.empty()) {
+            asks.sweep(
+                400, [](currency_type) { return true; },
+                [&](const perna::resting_order_type &offer, quantity_type exec_quantity) {
+                    if (exec_quantity == offer.quantity) {
+                        index.erase(offer.id);
+                    }
+                    ++fills;
+                });
+        }
+        return fills;
+    });
+    munmap(image, image_length);
+    unlink(image_filename);
+    print_phase(policy_name, "map", map);
+    print_phase(policy_name, "rest", rest);
+    print_phase(policy_name, "match", match);
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    const char *image_filename = "lambda-bench.bin";
+    uint64_t image_gib = 4;
+    uint64_t orders = 8000000;
+    uint64_t levels = 512;
+    int end = 0;
+    for (int i = 1; i < argc; ++i) {
+        end = 0;
+        if (sscanf(argv[i], "--image-filename=%n", &end) == 0 && end != 0) {
+            image_filename = argv[i] + end;
+        } else if (sscanf(argv[i], "--image-gib=%" SCNu64 "%n", &image_gib, &end) == 1 && argv[i][end] == 0) {
+            ;
+        } else if (sscanf(argv[i], "--orders=%" SCNu64 "%n", &orders, &end) == 1 && argv[i][end] == 0) {
+            ;
+        } else if (sscanf(argv[i], "--levels=%" SCNu64 "%n", &levels, &end) == 1 && argv[i][end] == 0) {
+            ;
+        } else {
+            (void) fprintf(stderr, "[bench] invalid argument '%s'\n", argv[i]);
+            return 1;
+        }
+    }
+    auto image_length = image_gib << 30;
+    (void) printf("%" PRIu64 " GiB image at '%s', %" PRIu64 " orders over %" PRIu64 " price levels\n", image_gib,
+        image_filename, orders, levels);
+    (void) printf("%-10s %-6s %12s %12s %8s %10s %10s\n", "policy", "phase", "operations", "minor", "major", "ms",
+        "ns/op");
+    struct {
+        const char *name;
+        lambda_mapping_policy_type policy;
+    } policies[] = {
+        {"default", {.huge_pages = false, .prefault = false}},
+        {"prefault", {.huge_pages = false, .prefault = true}},
+        {"huge", {.huge_pages = true, .prefault = false}},
+        {"huge+pre", {.huge_pages = true, .prefault = true}},
+    };
+    for (const auto &p : policies) {
+        if (!run(p.name, p.policy, image_filename, image_length, orders, levels)) {
+            return 1;
+        }
+    }
+    return 0;
+}
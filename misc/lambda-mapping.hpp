@@ -0,0 +1,84 @@
+#ifndef LAMBDA_MAPPING_H
+#define LAMBDA_MAPPING_H
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#include <ctime>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// Page policy for lambda images mapped by the host backends
+
+// By default pages are faulted in one at a time as the arena first touches them. Huge pages cut the number of
+// faults and TLB misses when the image is on a filesystem that backs shared mappings with them, such as tmpfs with
+// shmem_enabled set to advise. Prefaulting moves every fault to the moment the image is mapped, which also
+// allocates the blocks of a sparse image file.
+struct lambda_mapping_policy_type {
+    bool huge_pages = false; // ask for transparent huge pages
+    bool prefault = false;   // fault in every page for writing when mapped
+};
+
+// When changes to the lambda are flushed to the image file.
+// Without an input journal the image is mapped shared, so the kernel may write any page back at any moment, and an
+// image left by a crash can mix pages from before and after the input being processed. Flushing after every input
+// then only bounds how much of the work is sure to be on disk. Flushing every few inputs, every few seconds or once per
+// epoch takes an input journal: the image is then mapped privately, a flush writes a whole checkpoint of the lambda,
+// and a crash loses nothing the journal holds, whichever the policy.
+enum class lambda_durability_what : uint8_t {
+    input,   // after every input
+    inputs,  // after every count inputs
+    epoch,   // when the first input of the next epoch arrives, and on exit
+    seconds, // after the first input processed count seconds after the last flush
+};
+
+struct lambda_durability_policy_type {
+    lambda_durability_what what = lambda_durability_what::input;
+    uint64_t count = 1; // inputs or seconds between flushes, for lambda_durability_what::inputs and seconds
+};
+
+// Monotonic time in seconds, which times the flushes of the lambda
+[[maybe_unused]] static uint64_t lambda_clock() {
+    timespec now{};
+    (void) clock_gettime(CLOCK_MONOTONIC, &now);
+    return static_cast<uint64_t>(now.tv_sec);
+}
+
+// Fault in every page of [start, start + length) for writing
+static bool prefault_lambda(void *start, size_t length) {
+    if (madvise(start, length, MADV_POPULATE_WRITE) == 0) {
+        return true;
+    }
+    if (errno != EINVAL) {
+        (void) fprintf(stderr, "[dapp] unable to prefault lambda (%s)\n", strerror(errno));
+        return false;
+    }
+    // kernels before 5.14 do not know MADV_POPULATE_WRITE, so touch every page instead
+    auto page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    auto *bytes = static_cast<volatile unsigned char *>(start);
+    for (size_t i = 0; i < length; i += page) {
+        bytes[i] = bytes[i];
+    }
+    return true;
+}
+
+// Apply policy to a lambda of length bytes mapped at start, prefaulting only from offset on, as the pages before it
+// were already taken care of when the lambda was first mapped
+[[maybe_unused]] static bool apply_lambda_mapping_policy(const lambda_mapping_policy_type &policy, void *start,
+    size_t length, size_t offset = 0) {
+    if (policy.huge_pages && madvise(start, length, MADV_HUGEPAGE) < 0) {
+        (void) fprintf(stderr, "[dapp] unable to ask for huge pages (%s)\n", strerror(errno));
+        return false;
+    }
+    if (policy.prefault && offset < length) {
+        return prefault_lambda(static_cast<unsigned char *>(start) + offset, length - offset);
+    }
+    return true;
+}
+
+#endif
@@ -3,9 +3,18 @@
 ////////////////////////////////////////////////////////////////////////////////
 // Rollup utilities for bare metal execution
 
+#include "input-journal.hpp"
+#include "lambda-mapping.hpp"
+
 struct rollup_config_type {
-    uint64_t lambda_virtual_start = 0;
     const char *image_filename = nullptr;
+    lambda_mapping_policy_type lambda_mapping;
+    lambda_durability_policy_type lambda_durability;
+    const char *journal_filename = nullptr;  // journal inputs and only checkpoint the image, if set
+    uint64_t journal_group = 64;             // inputs appended to the journal between syncs, unless they have outputs
+    const char *snapshot_filename = nullptr; // publish snapshots of the lambda for inspect servers, if set
+    uint64_t snapshot_interval = 256;        // inputs between snapshots, each a copy of the whole used lambda
+    uint64_t snapshot_seconds = 1;           // seconds after which the next input is published even before the interval
     int input_begin = 0;
     int input_end = 0;
     int query_begin = 0;
@@ -18,23 +27,41 @@ struct rollup_config_type {
 struct rollup_state_type {
     void *lambda;
     size_t lambda_length;
+    uint64_t unflushed_input_count;   // inputs processed since the lambda was last flushed
+    uint64_t flushed_at;              // monotonic time in seconds of the last flush
+    uint64_t unpublished_input_count; // inputs processed since the last snapshot
+    uint64_t published_at;            // monotonic time in seconds of the last snapshot
     int current_input;
     int current_query;
     int current_voucher;
     int current_report;
     int current_notice;
     rollup_config_type config;
+    input_journal_type journal;
+    uint64_t journal_sequence; // inputs the lambda took before the next journal record
+    int image_fd;              // kept open while journaling, as the mapping outlives the image file it came from
+    bool replaying;            // replaying the journal, so outputs are named after the inputs being replayed
 };
 
 rollup_state_type *rollup_open(const rollup_config_type &config) {
     static rollup_state_type rollup_state{.lambda = nullptr,
         .lambda_length = 0,
+        .unflushed_input_count = 0,
+        .flushed_at = 0,
+        .unpublished_input_count = 0,
+        .published_at = 0,
         .current_input = 0,
         .current_query = 0,
         .current_voucher = 0,
         .current_report = 0,
-        .current_notice = 0};
+        .current_notice = 0,
+        .config = {},
+        .journal = {},
+        .journal_sequence = 0,
+        .image_fd = -1,
+        .replaying = false};
     rollup_state.config = config;
+    rollup_state.flushed_at = lambda_clock();
     if (config.input_begin != config.input_end) {
         if (!config.input_format) {
             (void) fprintf(stderr, "[dapp] missing rollup input format\n");
@@ -67,23 +94,188 @@ rollup_state_type *rollup_open(const rollup_config_type &config) {
         return nullptr;
     }
     rollup_state.lambda_length = static_cast<size_t>(off);
-    rollup_state.lambda = mmap(reinterpret_cast<void *>(config.lambda_virtual_start), rollup_state.lambda_length,
-        PROT_WRITE | PROT_READ, MAP_SHARED | MAP_FIXED_NOREPLACE, memfd, 0);
-    close(memfd);
+    // With a journal the mapping is private, so changes only reach the image file when the lambda is checkpointed
+    if (config.journal_filename && !rollup_state.journal.open(config.journal_filename, config.journal_group)) {
+        close(memfd);
+        return nullptr;
+    }
+    auto sharing = config.journal_filename ? MAP_PRIVATE : MAP_SHARED;
+    // the lambda is position independent, so let the kernel pick the address
+    rollup_state.lambda = mmap(nullptr, rollup_state.lambda_length, PROT_WRITE | PROT_READ, sharing, memfd, 0);
+    if (config.journal_filename) {
+        rollup_state.image_fd = memfd;
+    } else {
+        close(memfd);
+    }
     if (rollup_state.lambda == MAP_FAILED) {
         (void) fprintf(stderr, "[dapp] mmap failed (%s)\n", strerror(errno));
         return nullptr;
     }
-    if (rollup_state.lambda != reinterpret_cast<void *>(config.lambda_virtual_start)) {
-        fprintf(stderr, "[dapp] mmap mapped wrong virtual address\n");
+    if (!apply_lambda_mapping_policy(config.lambda_mapping, rollup_state.lambda, rollup_state.lambda_length)) {
         munmap(rollup_state.lambda, rollup_state.lambda_length);
         return nullptr;
     }
-    (void) fprintf(stderr, "[dapp] lambda virtual start: 0x%016" PRIx64 "\n", config.lambda_virtual_start);
+    (void) fprintf(stderr, "[dapp] lambda virtual start: %p\n", rollup_state.lambda);
     (void) fprintf(stderr, "[dapp] lambda length: 0x%016" PRIx64 "\n", rollup_state.lambda_length);
     return &rollup_state;
 }
 
+// Extend the image file to length and map it again, possibly at another address, as the lambda is position
+// independent.
+[[maybe_unused]] static bool rollup_grow_lambda(rollup_state_type *rollup_state, size_t length) {
+    // a private mapping stays on the file it was made from even after checkpoints replaced it
+    auto extended = rollup_state->image_fd >= 0 ? ftruncate(rollup_state->image_fd, static_cast<off_t>(length))
+                                                : truncate(rollup_state->config.image_filename, static_cast<off_t>(length));
+    if (extended < 0) {
+        (void) fprintf(stderr, "[dapp] unable to extend image file '%s' (%s)\n", rollup_state->config.image_filename,
+            strerror(errno));
+        return false;
+    }
+    auto *lambda = mremap(rollup_state->lambda, rollup_state->lambda_length, length, MREMAP_MAYMOVE);
+    if (lambda == MAP_FAILED) {
+        (void) fprintf(stderr, "[dapp] mremap failed (%s)\n", strerror(errno));
+        return false;
+    }
+    auto old_length = rollup_state->lambda_length;
+    rollup_state->lambda = lambda;
+    rollup_state->lambda_length = length;
+    if (!apply_lambda_mapping_policy(rollup_state->config.lambda_mapping, lambda, length, old_length)) {
+        return false;
+    }
+    (void) fprintf(stderr, "[dapp] lambda virtual start: %p\n", rollup_state->lambda);
+    (void) fprintf(stderr, "[dapp] lambda length: 0x%016" PRIx64 "\n", rollup_state->lambda_length);
+    return true;
+}
+
+// Sync the directory holding filename, so a file renamed into it stays there
+static bool rollup_sync_directory(const char *filename) {
+    char directory[FILENAME_MAX];
+    snprintf(directory, std::size(directory), "%s", filename);
+    auto *slash = strrchr(directory, '/');
+    if (!slash) {
+        snprintf(directory, std::size(directory), ".");
+    } else if (slash == directory) {
+        slash[1] = 0;
+    } else {
+        *slash = 0;
+    }
+    int fd = open(directory, O_RDONLY | O_DIRECTORY);
+    if (fd < 0 || fsync(fd) < 0) {
+        (void) fprintf(stderr, "[dapp] unable to sync directory '%s' (%s)\n", directory, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return false;
+    }
+    close(fd);
+    return true;
+}
+
+// Copy the lambda, whose first length bytes hold everything in use, to a new file that then replaces target, syncing
+// the copy first if durable. Whoever opens target always finds a whole copy, whatever the moment of a crash, and
+// whoever mapped target before keeps the copy it mapped.
+static bool rollup_replace_lambda_copy(rollup_state_type *rollup_state, const char *target, size_t length,
+    bool durable) {
+    char filename[FILENAME_MAX];
+    snprintf(filename, std::size(filename), "%s.new", target);
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        (void) fprintf(stderr, "[dapp] unable to open '%s' (%s)\n", filename, strerror(errno));
+        return false;
+    }
+    length = std::min(length, rollup_state->lambda_length);
+    const auto *bytes = static_cast<const unsigned char *>(rollup_state->lambda);
+    bool written = ftruncate(fd, static_cast<off_t>(rollup_state->lambda_length)) == 0;
+    for (size_t done = 0; written && done < length;) {
+        auto n = pwrite(fd, bytes + done, length - done, static_cast<off_t>(done));
+        written = n > 0;
+        done += written ? static_cast<size_t>(n) : 0;
+    }
+    written = written && (!durable || fsync(fd) == 0);
+    close(fd);
+    if (!written) {
+        (void) fprintf(stderr, "[dapp] unable to write '%s' (%s)\n", filename, strerror(errno));
+        return false;
+    }
+    if (rename(filename, target) < 0) {
+        (void) fprintf(stderr, "[dapp] unable to replace '%s' (%s)\n", target, strerror(errno));
+        return false;
+    }
+    return !durable || rollup_sync_directory(target);
+}
+
+// Checkpoint the lambda, whose first length bytes hold everything in use, to the image file and empty the journal
+[[maybe_unused]] static bool rollup_checkpoint_lambda(rollup_state_type *rollup_state, size_t length) {
+    return rollup_replace_lambda_copy(rollup_state, rollup_state->config.image_filename, length, true) &&
+        rollup_state->journal.clear();
+}
+
+// Publish a snapshot of the lambda, whose first length bytes hold everything in use, for inspect servers to map.
+// Snapshots are read while the lambda keeps advancing, and a crash only loses a view the next snapshot replaces, so
+// they are not synced.
+[[maybe_unused]] static bool rollup_publish_lambda(rollup_state_type *rollup_state, size_t length) {
+    return rollup_replace_lambda_copy(rollup_state, rollup_state->config.snapshot_filename, length, false);
+}
+
+// Advance the lambda, which took applied inputs so far, through the inputs in the journal it did not take yet, writing
+// their outputs again.
+template <typename LAMBDA, typename ADVANCE_INPUT, typename ADVANCE_STATE>
+[[maybe_unused]] static bool rollup_replay_journal(rollup_state_type *rollup_state, ADVANCE_STATE advance_cb,
+    uint64_t applied) {
+    rollup_state->journal_sequence = applied;
+    if (!rollup_state->journal.is_open()) {
+        return true;
+    }
+    bool consistent = true;
+    uint64_t replayed = 0;
+    rollup_state->replaying = true;
+    bool read = rollup_state->journal.replay([&](const journal_record_type &record) {
+        // records before the sequence are already in the checkpoint
+        if (!consistent || record.header.sequence < rollup_state->journal_sequence) {
+            return;
+        }
+        if (record.header.sequence != rollup_state->journal_sequence ||
+            record.header.metadata_length != sizeof(input_metadata_type) ||
+            record.header.payload_length > sizeof(ADVANCE_INPUT)) {
+            (void) fprintf(stderr, "[dapp] journal record %" PRIu64 " does not follow the lambda\n",
+                record.header.sequence);
+            consistent = false;
+            return;
+        }
+        input_metadata_type metadata{};
+        std::memcpy(&metadata, record.metadata, sizeof(metadata));
+        ADVANCE_INPUT payload{};
+        std::memcpy(&payload, record.payload, record.header.payload_length);
+        rollup_state->current_input = record.header.input_index;
+        rollup_state->current_notice = rollup_state->current_voucher = rollup_state->current_report = 0;
+        ++rollup_state->journal_sequence;
+        (void) advance_cb(rollup_state, reinterpret_cast<LAMBDA *>(rollup_state->lambda), metadata, payload,
+            record.header.payload_length);
+        ++replayed;
+    });
+    rollup_state->replaying = false;
+    (void) fprintf(stderr, "[dapp] replayed %" PRIu64 " inputs from journal\n", replayed);
+    return read && consistent;
+}
+
+// Write length bytes of data to a new file, with plain system calls, as stdio would allocate a buffer for every file
+// written while an input is processed
+static bool write_output_file(const char *filename, const void *data, size_t length) {
+    (void) fprintf(stderr, "Storing %s\n", filename);
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        (void) fprintf(stderr, "Unable open %s for writing (%s)\n", filename, strerror(errno));
+        return false;
+    }
+    auto written = write(fd, data, length);
+    close(fd);
+    if (written < 0 || static_cast<size_t>(written) < length) {
+        (void) fprintf(stderr, "Unable write to %s (%s)\n", filename, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
 // Process rollup requests until there are no more inputs.
 template <typename LAMBDA, typename ADVANCE_INPUT, typename INSPECT_QUERY, typename ADVANCE_STATE,
     typename INSPECT_STATE>
@@ -102,8 +294,18 @@ static int rollup_request_loop(rollup_state_type *rollup_state, ADVANCE_STATE ad
         be256 length;
         INSPECT_QUERY payload;
     } __attribute__((packed));
-    for (rollup_state->current_input = rollup_state->config.input_begin;
-        rollup_state->current_input < rollup_state->config.input_end; ++rollup_state->current_input) {
+    // Input indices count the inputs of the rollup, and the lambda takes every one of them in order, so with a
+    // journal the inputs before journal_sequence are already in the checkpoint or were replayed from the journal
+    rollup_state->current_input = rollup_state->config.input_begin;
+    if (rollup_state->journal.is_open() && rollup_state->current_input < rollup_state->config.input_end &&
+        rollup_state->journal_sequence > static_cast<uint64_t>(rollup_state->current_input)) {
+        auto taken = static_cast<int>(
+            std::min<uint64_t>(rollup_state->journal_sequence, static_cast<uint64_t>(rollup_state->config.input_end)));
+        (void) fprintf(stderr, "[dapp] skipping inputs %d to %d already taken\n", rollup_state->current_input,
+            taken - 1);
+        rollup_state->current_input = taken;
+    }
+    for (; rollup_state->current_input < rollup_state->config.input_end; ++rollup_state->current_input) {
         // Start report/notice/voucher counters anew
         rollup_state->current_notice = rollup_state->current_voucher = rollup_state->current_report = 0;
         char filename[FILENAME_MAX];
@@ -149,9 +351,17 @@ static int rollup_request_loop(rollup_state_type *rollup_state, ADVANCE_STATE ad
             return 1;
         }
         fclose(fin);
+        auto length = read - (sizeof(raw_input) - sizeof(ADVANCE_INPUT));
+        // Journal the input before the lambda takes it
+        if (rollup_state->journal.is_open() &&
+            !rollup_state->journal.append(rollup_state->journal_sequence++, rollup_state->current_input,
+                &raw_input_metadata.metadata, sizeof(input_metadata_type), &raw_input.payload,
+                static_cast<uint32_t>(length))) {
+            return 1;
+        }
         // Invoke callback
         bool accept = advance_cb(rollup_state, reinterpret_cast<LAMBDA *>(rollup_state->lambda),
-            raw_input_metadata.metadata, raw_input.payload, read - (sizeof(raw_input) - sizeof(ADVANCE_INPUT)));
+            raw_input_metadata.metadata, raw_input.payload, length);
         if (accept) {
             (void) fprintf(stderr, "Accepted input %d\n", rollup_state->current_input);
         } else {
@@ -198,43 +408,44 @@ static int rollup_request_loop(rollup_state_type *rollup_state, ADVANCE_STATE ad
 
 template <typename T>
 [[nodiscard, maybe_unused]] static bool rollup_write_data(rollup_state_type *rollup_state, const T &payload,
-    const char *what, int &index) {
+    uint64_t length, const char *what, int &index) {
     struct raw_data_type {
         be256 offset;
         be256 length;
         T payload;
     };
-    raw_data_type data{.offset = to_be256(32), .length = to_be256(sizeof(payload)), .payload = payload};
+    length = std::min<uint64_t>(length, sizeof(T));
+    raw_data_type data{.offset = to_be256(32), .length = to_be256(length), .payload = payload};
     char filename[FILENAME_MAX];
-    if (rollup_state->current_input <= rollup_state->config.input_end) {
+    if (rollup_state->replaying || rollup_state->current_input <= rollup_state->config.input_end) {
         snprintf(filename, std::size(filename), "input-%d-%s-%d.bin", rollup_state->current_input, what, index);
     } else {
         snprintf(filename, std::size(filename), "query-%d-%s-%d.bin", rollup_state->current_query, what, index);
     }
-    (void) fprintf(stderr, "Storing %s\n", filename);
-    auto *fout = fopen(filename, "w");
-    if (!fout) {
-        (void) fprintf(stderr, "Unable open %s for writing (%s)\n", filename, strerror(errno));
-        return false;
-    }
-    auto written = fwrite(&data, 1, sizeof(data), fout);
-    if (written < sizeof(data)) {
-        (void) fprintf(stderr, "Unable write to %s (%s)\n", filename, strerror(errno));
+    // the input an output comes from is made durable before the output is written
+    if (!rollup_state->journal.sync() ||
+        !write_output_file(filename, &data, offsetof(raw_data_type, payload) + length)) {
         return false;
     }
-    fclose(fout);
     ++index;
     return true;
 }
 
 template <typename T>
 [[nodiscard, maybe_unused]] static bool rollup_write_report(rollup_state_type *rollup_state, const T &payload) {
-    return rollup_write_data(rollup_state, payload, "report", rollup_state->current_report);
+    return rollup_write_data(rollup_state, payload, sizeof(T), "report", rollup_state->current_report);
 }
 
 template <typename T>
 [[nodiscard, maybe_unused]] static bool rollup_write_notice(rollup_state_type *rollup_state, const T &payload) {
-    return rollup_write_data(rollup_state, payload, "notice", rollup_state->current_notice);
+    return rollup_write_data(rollup_state, payload, sizeof(T), "notice", rollup_state->current_notice);
+}
+
+// Writes only the first length bytes of payload, for notices that end in a variable number of entries.
+template <typename T>
+[[nodiscard, maybe_unused]] static bool rollup_write_notice(rollup_state_type *rollup_state, const T &payload,
+    uint64_t length) {
+    return rollup_write_data(rollup_state, payload, length, "notice", rollup_state->current_notice);
 }
 
 template <typename T>
@@ -253,25 +464,16 @@ template <typename T>
         .length = to_be256(sizeof(payload)),
         .payload = payload};
     char filename[FILENAME_MAX];
-    if (rollup_state->current_input <= rollup_state->config.input_end) {
+    if (rollup_state->replaying || rollup_state->current_input <= rollup_state->config.input_end) {
         snprintf(filename, std::size(filename), "input-%d-voucher-%d.bin", rollup_state->current_input,
             rollup_state->current_voucher);
     } else {
         snprintf(filename, std::size(filename), "query-%d-voucher-%d.bin", rollup_state->current_query,
             rollup_state->current_voucher);
     }
-    (void) fprintf(stderr, "Storing %s\n", filename);
-    auto *fout = fopen(filename, "w");
-    if (!fout) {
-        (void) fprintf(stderr, "Unable open %s for writing (%s)\n", filename, strerror(errno));
-        return false;
-    }
-    auto written = fwrite(&voucher, 1, sizeof(voucher), fout);
-    if (written < sizeof(voucher)) {
-        (void) fprintf(stderr, "Unable write to %s (%s)\n", filename, strerror(errno));
+    if (!rollup_state->journal.sync() || !write_output_file(filename, &voucher, sizeof(voucher))) {
         return false;
     }
-    fclose(fout);
     ++rollup_state->current_voucher;
     return true;
 }
@@ -37,10 +37,13 @@ template <typename T>
     return true;
 }
 
+// Writes only the first length bytes of payload, for notices that end in a variable number of entries.
 template <typename T>
-[[nodiscard, maybe_unused]] static bool rollup_write_notice(rollup_state_type *rollup_state, const T &payload) {
+[[nodiscard, maybe_unused]] static bool rollup_write_notice(rollup_state_type *rollup_state, const T &payload,
+    uint64_t length) {
     rollup_notice notice{};
-    notice.payload = {const_cast<uint8_t *>(reinterpret_cast<const uint8_t *>(&payload)), sizeof(T)};
+    notice.payload = {const_cast<uint8_t *>(reinterpret_cast<const uint8_t *>(&payload)),
+        std::min<uint64_t>(length, sizeof(T))};
     if (ioctl(rollup_state->fd, IOCTL_ROLLUP_WRITE_NOTICE, &notice) < 0) {
         (void) fprintf(stderr, "[dapp] unable to write rollup report: %s\n", strerror(errno));
         return false;
@@ -48,6 +51,11 @@ template <typename T>
     return true;
 }
 
+template <typename T>
+[[nodiscard, maybe_unused]] static bool rollup_write_notice(rollup_state_type *rollup_state, const T &payload) {
+    return rollup_write_notice(rollup_state, payload, sizeof(T));
+}
+
 template <typename T>
 [[nodiscard, maybe_unused]] static bool rollup_write_voucher(rollup_state_type *rollup_state,
     const eth_address &destination, const T &payload) {
@@ -134,7 +142,7 @@ template <typename LAMBDA, typename ADVANCE_INPUT, typename INSPECT_QUERY, typen
     // Unreachable code.
 }
 
-[[nodiscard]] rollup_state_type *rollup_open(uint64_t lambda_virtual_start, const char *lambda_drive_label) {
+[[nodiscard]] rollup_state_type *rollup_open(const char *lambda_drive_label) {
     static rollup_state_type rollup_state{};
     // Open rollup device.
     rollup_state.fd = open(ROLLUP_DEVICE_NAME, O_RDWR);
@@ -182,19 +190,14 @@ template <typename LAMBDA, typename ADVANCE_INPUT, typename INSPECT_QUERY, typen
         return nullptr;
     }
     rollup_state.lambda_length = static_cast<size_t>(off);
-    rollup_state.lambda = mmap(reinterpret_cast<void *>(lambda_virtual_start), rollup_state.lambda_length,
-        PROT_WRITE | PROT_READ, MAP_SHARED | MAP_FIXED_NOREPLACE, memfd, 0);
+    // the lambda is position independent, so let the kernel pick the address
+    rollup_state.lambda = mmap(nullptr, rollup_state.lambda_length, PROT_WRITE | PROT_READ, MAP_SHARED, memfd, 0);
     close(memfd);
     if (rollup_state.lambda == MAP_FAILED) {
         (void) fprintf(stderr, "mmap failed (%s)\n", strerror(errno));
         return nullptr;
     }
-    if (rollup_state.lambda != reinterpret_cast<void *>(lambda_virtual_start)) {
-        fprintf(stderr, "[dapp] mmap mapped wrong virtual address\n");
-        munmap(rollup_state.lambda, rollup_state.lambda_length);
-        return nullptr;
-    }
-    (void) fprintf(stderr, "[dapp] lambda virtual start: 0x%016" PRIx64 "\n", lambda_virtual_start);
+    (void) fprintf(stderr, "[dapp] lambda virtual start: %p\n", rollup_state.lambda);
     (void) fprintf(stderr, "[dapp] lambda length: 0x%016" PRIx64 "\n", rollup_state.lambda_length);
     return &rollup_state;
 }
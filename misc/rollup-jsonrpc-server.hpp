@@ -27,13 +27,16 @@
 #include <fcntl.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include "json-util.h"
+#include "lambda-mapping.hpp"
 
 struct rollup_config_type {
-    uint64_t lambda_virtual_start = 0;
     const char *image_filename = nullptr;
+    lambda_mapping_policy_type lambda_mapping;
+    lambda_durability_policy_type lambda_durability;
     const char *server_address = nullptr;
 };
 
@@ -82,6 +85,11 @@ enum class http_handler_status {
 struct rollup_state_type {
     void *lambda;
     size_t lambda_length;
+    uint64_t unflushed_input_count; // inputs processed since the lambda was last flushed
+    uint64_t flushed_at;            // monotonic time in seconds of the last flush
+    dev_t lambda_device;            // device and inode of the image file the lambda was mapped from
+    ino_t lambda_inode;
+    uint64_t refreshed_at;          // monotonic time in seconds the image file was last looked up
     rollup_config_type config;
     http_handler_status status;                ///< Status of last request
     mg_mgr event_manager;                      ///< Mongoose event manager
@@ -91,6 +99,9 @@ struct rollup_state_type {
 /// \brief Forward declaration of http handler
 static void http_handler(mg_connection *con, int ev, void *ev_data, void *h_data);
 
+/// \brief Forward declaration of the lambda refresh before each inspect
+static void rollup_refresh_lambda(rollup_state_type *rollup_state);
+
 /// \brief Names for JSONRPC error codes
 enum jsonrpc_error_code : int {
     parse_error = -32700,      ///< When the request failed to parse
@@ -433,6 +444,7 @@ static json jsonrpc_inspect_handler(const json &j, mg_connection *con, rollup_st
     (void) con;
     static const char *param_name[] = {"query"};
     auto args = parse_args<query_type>(j, param_name);
+    rollup_refresh_lambda(h);
     h->reports = json::array();
     bool ret = inspect_state(h, reinterpret_cast<lambda_type *>(h->lambda), std::get<0>(args), sizeof(query_type));
     return jsonrpc_response_ok(j, {{"reports", h->reports }, { "accept", ret} });
@@ -593,9 +605,16 @@ static void http_handler(mg_connection *con, int ev, void *ev_data, void *h_data
 rollup_state_type *rollup_open(const rollup_config_type &config) {
     static rollup_state_type rollup_state{
         .lambda = nullptr,
-        .lambda_length = 0
+        .lambda_length = 0,
+        .unflushed_input_count = 0,
+        .flushed_at = 0,
+        .lambda_device = 0,
+        .lambda_inode = 0,
+        .refreshed_at = 0
     };
     rollup_state.config = config;
+    rollup_state.flushed_at = lambda_clock();
+    rollup_state.refreshed_at = rollup_state.flushed_at;
     if (!config.image_filename) {
         (void) fprintf(stderr, "[dapp] missing image filename\n");
         return nullptr;
@@ -609,26 +628,27 @@ rollup_state_type *rollup_open(const rollup_config_type &config) {
         fprintf(stderr, "[dapp] open failed for '%s' (%s)\n", config.image_filename, strerror(errno));
         return nullptr;
     }
-    auto off = lseek(memfd, 0, SEEK_END);
-    if (off < 0) {
+    struct stat image {};
+    if (fstat(memfd, &image) < 0) {
         (void) fprintf(stderr, "[dapp] unable to get length of image file (%s)\n", config.image_filename);
         close(memfd);
         return nullptr;
     }
-    rollup_state.lambda_length = static_cast<size_t>(off);
-    rollup_state.lambda = mmap(reinterpret_cast<void *>(config.lambda_virtual_start), rollup_state.lambda_length,
-        PROT_WRITE | PROT_READ, MAP_SHARED | MAP_FIXED_NOREPLACE, memfd, 0);
+    rollup_state.lambda_length = static_cast<size_t>(image.st_size);
+    rollup_state.lambda_device = image.st_dev;
+    rollup_state.lambda_inode = image.st_ino;
+    // the lambda is position independent, so let the kernel pick the address
+    rollup_state.lambda = mmap(nullptr, rollup_state.lambda_length, PROT_WRITE | PROT_READ, MAP_SHARED, memfd, 0);
     close(memfd);
     if (rollup_state.lambda == MAP_FAILED) {
         (void) fprintf(stderr, "[dapp] mmap failed (%s)\n", strerror(errno));
         return nullptr;
     }
-    if (rollup_state.lambda != reinterpret_cast<void *>(config.lambda_virtual_start)) {
-        fprintf(stderr, "[dapp] mmap mapped wrong virtual address\n");
+    if (!apply_lambda_mapping_policy(config.lambda_mapping, rollup_state.lambda, rollup_state.lambda_length)) {
         munmap(rollup_state.lambda, rollup_state.lambda_length);
         return nullptr;
     }
-    (void) fprintf(stderr, "[dapp] lambda virtual start: 0x%016" PRIx64 "\n", config.lambda_virtual_start);
+    (void) fprintf(stderr, "[dapp] lambda virtual start: %p\n", rollup_state.lambda);
     (void) fprintf(stderr, "[dapp] lambda length: 0x%016" PRIx64 "\n", rollup_state.lambda_length);
 
     install_signal_handlers();
@@ -652,6 +672,78 @@ rollup_state_type *rollup_open(const rollup_config_type &config) {
     return &rollup_state;
 }
 
+// Extend the image file to length and map it again, possibly at another address, as the lambda is position
+// independent.
+[[maybe_unused]] static bool rollup_grow_lambda(rollup_state_type *rollup_state, size_t length) {
+    if (truncate(rollup_state->config.image_filename, static_cast<off_t>(length)) < 0) {
+        (void) fprintf(stderr, "[dapp] unable to extend image file '%s' (%s)\n", rollup_state->config.image_filename,
+            strerror(errno));
+        return false;
+    }
+    auto *lambda = mremap(rollup_state->lambda, rollup_state->lambda_length, length, MREMAP_MAYMOVE);
+    if (lambda == MAP_FAILED) {
+        (void) fprintf(stderr, "[dapp] mremap failed (%s)\n", strerror(errno));
+        return false;
+    }
+    auto old_length = rollup_state->lambda_length;
+    rollup_state->lambda = lambda;
+    rollup_state->lambda_length = length;
+    if (!apply_lambda_mapping_policy(rollup_state->config.lambda_mapping, lambda, length, old_length)) {
+        return false;
+    }
+    (void) fprintf(stderr, "[dapp] lambda virtual start: %p\n", rollup_state->lambda);
+    (void) fprintf(stderr, "[dapp] lambda length: 0x%016" PRIx64 "\n", rollup_state->lambda_length);
+    return true;
+}
+
+// Seconds between looks at whether the image file was replaced
+constexpr uint64_t LAMBDA_REFRESH_INTERVAL = 1;
+
+// Map the image file again if it was replaced since the lambda was mapped, as when it is a snapshot published by a bare
+// metal dapp after every few inputs. Every inspect then reads one whole snapshot, taken between inputs, without ever
+// holding back the dapp that keeps advancing the lambda. Snapshots are shared by every server reading them, so they
+// are mapped privately. The lambda stays as it was if the new image file cannot be mapped or holds no valid lambda.
+// The image file is looked up at most once per refresh interval, so a burst of inspects costs no more than one stat.
+static void rollup_refresh_lambda(rollup_state_type *rollup_state) {
+    auto now = lambda_clock();
+    if (now - rollup_state->refreshed_at < LAMBDA_REFRESH_INTERVAL) {
+        return;
+    }
+    rollup_state->refreshed_at = now;
+    struct stat image {};
+    if (stat(rollup_state->config.image_filename, &image) < 0 ||
+        (image.st_dev == rollup_state->lambda_device && image.st_ino == rollup_state->lambda_inode)) {
+        return;
+    }
+    int memfd = open(rollup_state->config.image_filename, O_RDONLY);
+    // the image file may have been replaced again since it was looked up, so look up what was opened
+    if (memfd < 0 || fstat(memfd, &image) < 0) {
+        (void) fprintf(stderr, "[dapp] unable to open new image file '%s' (%s)\n", rollup_state->config.image_filename,
+            strerror(errno));
+        if (memfd >= 0) {
+            close(memfd);
+        }
+        return;
+    }
+    auto length = static_cast<size_t>(image.st_size);
+    auto *lambda = mmap(nullptr, length, PROT_WRITE | PROT_READ, MAP_PRIVATE, memfd, 0);
+    close(memfd);
+    if (lambda == MAP_FAILED) {
+        (void) fprintf(stderr, "[dapp] mmap failed (%s)\n", strerror(errno));
+        return;
+    }
+    if (!validate_lambda(static_cast<const lambda_type *>(lambda), length, true) ||
+        !apply_lambda_mapping_policy(rollup_state->config.lambda_mapping, lambda, length)) {
+        munmap(lambda, length);
+        return;
+    }
+    munmap(rollup_state->lambda, rollup_state->lambda_length);
+    rollup_state->lambda = lambda;
+    rollup_state->lambda_length = length;
+    rollup_state->lambda_device = image.st_dev;
+    rollup_state->lambda_inode = image.st_ino;
+}
+
 // Process rollup requests until there are no more inputs.
 template <typename LAMBDA, typename ADVANCE_INPUT, typename INSPECT_QUERY, typename ADVANCE_STATE,
     typename INSPECT_STATE>
@@ -681,6 +773,12 @@ template <typename T>
     return true;
 }
 
+template <typename T>
+[[nodiscard, maybe_unused]] static bool rollup_write_notice(rollup_state_type *rollup_state, const T &payload,
+    uint64_t length) {
+    return true;
+}
+
 template <typename T>
 [[nodiscard, maybe_unused]] static bool rollup_write_voucher(rollup_state_type *rollup_state,
     const eth_address &destination, const T &payload) {